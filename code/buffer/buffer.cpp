@@ -2,36 +2,56 @@
  * @Author       : mark
  * @Date         : 2020-06-26
  * @copyleft Apache 2.0
- */ 
+ */
 #include "buffer.h"
 
-Buffer::Buffer(int initBuffSize) : buffer_(initBuffSize), readPos_(0), writePos_(0) {}
+/// 块在第一次写入时才取，构造不分配内存
+Buffer::Buffer(int initBuffSize) : readable_(0), initSize_(initBuffSize > 0 ? initBuffSize : 1) {}
 
+Buffer::~Buffer() {
+    ReleaseAll_();
+}
 
 /// 返回缓存区剩余的未读数据大小
 size_t Buffer::ReadableBytes() const {
-    return writePos_ - readPos_;
+    return readable_;
 }
 
-/// 返回剩余的缓存区大小
+/// 返回尾块剩余的空间大小
 size_t Buffer::WritableBytes() const {
-    return buffer_.size() - writePos_;
+    return chain_.empty() ? 0 : chain_.back().cap - chain_.back().write;
 }
 
-/// 返回缓存区读指针已经读到的位置
+/// 返回首块读指针已经读到的位置
 size_t Buffer::PrependableBytes() const {
-    return readPos_;
+    return chain_.empty() ? 0 : chain_.front().read;
 }
 
-/// 返回缓存区读指针已经读到的位置下一个数据的地址
+/// 返回下一个要读的数据的地址，后面ReadableBytes()个字节是连续的
 const char* Buffer::Peek() const {
-    return BeginPtr_() + readPos_;
+    if(chain_.empty()) { return ""; }
+    if(chain_.size() > 1) { Pullup_(); }
+    return chain_.front().data + chain_.front().read;
 }
 
-/// 读指针位置的重定位 len代表本次又读到的长度
+/// 读指针前移len，读完的块还给BufferPool
 void Buffer::Retrieve(size_t len) {
     assert(len <= ReadableBytes());
-    readPos_ += len;
+    readable_ -= len;
+    if(readable_ == 0) {
+        ReleaseAll_();
+        return;
+    }
+    while(len > 0) {
+        Block& front = chain_.front();
+        size_t n = std::min(len, front.write - front.read);
+        front.read += n;
+        len -= n;
+        if(front.read == front.write && chain_.size() > 1) {
+            BufferPool::Instance()->Free(front.data, front.cap);
+            chain_.erase(chain_.begin());
+        }
+    }
 }
 
 /// 将读指针的位置移到*end代表的地址处
@@ -40,14 +60,13 @@ void Buffer::RetrieveUntil(const char* end) {
     Retrieve(end - Peek());
 }
 
-/// 缓存区清零，读指针位置和写指针位置置为0
+/// 丢弃所有数据，块全部还回去；不用清零
 void Buffer::RetrieveAll() {
-    bzero(&buffer_[0], buffer_.size());
-    readPos_ = 0;
-    writePos_ = 0;
+    readable_ = 0;
+    ReleaseAll_();
 }
 
-/// 将缓存区没有读到的数据全部读出来，然后缓存区清零，读指针和写指针的位置重置为0
+/// 将缓存区没有读到的数据全部读出来，然后清空缓存区
 std::string Buffer::RetrieveAllToStr() {
     std::string str(Peek(), ReadableBytes());
     RetrieveAll();
@@ -55,27 +74,30 @@ std::string Buffer::RetrieveAllToStr() {
 }
 
 
-/// 返回剩余可以写的缓存区开始的地址  const
+/// 返回尾块剩余可以写的空间开始的地址  const
 const char* Buffer::BeginWriteConst() const {
-    return BeginPtr_() + writePos_;
+    return chain_.empty() ? nullptr : chain_.back().data + chain_.back().write;
 }
 
-/// 返回剩余可以写的缓存区开始的地址
+/// 返回尾块剩余可以写的空间开始的地址，先用EnsureWriteable()保证空间
 char* Buffer::BeginWrite() {
-    return BeginPtr_() + writePos_;
+    return chain_.empty() ? nullptr : chain_.back().data + chain_.back().write;
 }
 
 /// 缓存区数据更改更新写后数据的写指针的位置
 void Buffer::HasWritten(size_t len) {
-    writePos_ += len;
-} 
+    assert(len <= WritableBytes());
+    if(len == 0) { return; }
+    chain_.back().write += len;
+    readable_ += len;
+}
 
-/// 在缓存区后面继续追加数据，如果数据太大，就触发扩容
+/// 在缓存区后面继续追加数据
 void Buffer::Append(const std::string& str) {
     Append(str.data(), str.length());
 }
 
-/// 在缓存区后面继续追加数据，如果数据太大，就触发扩容
+/// 在缓存区后面继续追加数据
 void Buffer::Append(const void* data, size_t len) {
     assert(data);
     Append(static_cast<const char*>(data), len);
@@ -84,33 +106,43 @@ void Buffer::Append(const void* data, size_t len) {
 /// 将str内存中的数据追加拷贝到缓存区中
 void Buffer::Append(const char* str, size_t len) {
     assert(str);
+    if(len == 0) { return; }
     EnsureWriteable(len);
-    std::copy(str, str + len, BeginWrite());
+    memcpy(BeginWrite(), str, len);
     HasWritten(len);
 }
 
-/// 在缓存区后面继续追加数据，如果数据太大，就触发扩容
+/// 在缓存区后面继续追加数据
 void Buffer::Append(const Buffer& buff) {
     Append(buff.Peek(), buff.ReadableBytes());
 }
 
-/// 如果剩余的缓存区大小小于了要写的长度，就触发扩容
+/// 尾块剩余的空间不够时接一个新块，已有的数据不动
 void Buffer::EnsureWriteable(size_t len) {
-    if(WritableBytes() < len) {   /// 如果剩余的缓存区大小小于了要写的长度，就触发扩容
-        MakeSpace_(len);      /// 扩容
+    if(WritableBytes() < len) {
+        /// 新块至少是上一块的两倍，数据一直追加时块数是对数级的
+        size_t size = std::max(len, initSize_);
+        if(!chain_.empty()) { size = std::max(size, std::min(chain_.back().cap * 2, BufferPool::MAX_BLOCK)); }
+        PushBlock_(size);
     }
     assert(WritableBytes() >= len);
 }
 
 ssize_t Buffer::ReadFd(int fd, int* saveErrno) {
-    char buff[65535];
+    size_t cap = 0;
+    char* extra = BufferPool::Instance()->Allocate(READ_BLOCK, &cap);
     struct iovec iov[2];
-    const size_t writable = WritableBytes();   /// 剩余可以写的数量
-    /* 分散读， 保证数据全部读完 */
-    iov[0].iov_base = BeginPtr_() + writePos_;  /// 剩余可以写的缓存区开始的地址
-    iov[0].iov_len = writable;                  /// 剩余可以写的缓存区的大小
-    iov[1].iov_base = buff;                     /// 扩展空间地址
-    iov[1].iov_len = sizeof(buff);              /// 扩展空间大小
+    int cnt = 0;
+    const size_t writable = WritableBytes();   /// 尾块剩余可以写的数量
+    /* 分散读：先填满尾块，多出来的读进新块 */
+    if(writable > 0) {
+        iov[cnt].iov_base = BeginWrite();
+        iov[cnt].iov_len = writable;
+        cnt++;
+    }
+    iov[cnt].iov_base = extra;
+    iov[cnt].iov_len = cap;
+    cnt++;
 
     /**
      * https://blog.csdn.net/xiaomiCJH/article/details/75344721
@@ -119,17 +151,19 @@ ssize_t Buffer::ReadFd(int fd, int* saveErrno) {
         ssize_t readn(int sockfd, struct iovec* iov, int iovcnt);
                 返回：若成功则为读或者写的字节数，若出错则为-1
     */
-    /// readv（）是分散读的意思，意思就是先读到iov[0]中，若iov[0]的空间不够了，就把多出来的数据放入到iov[1]中
-    const ssize_t len = readv(fd, iov, 2);
+    const ssize_t len = readv(fd, iov, cnt);
     if(len < 0) {    /// 如果读失败了，saveErrno标志位置为错误
         *saveErrno = errno;
+        BufferPool::Instance()->Free(extra, cap);
     }
-    else if(static_cast<size_t>(len) <= writable) {   /// 如果读到的大小小于缓存区剩余的空间，直接将数据放在缓存区后面
-        writePos_ += len;
+    else if(static_cast<size_t>(len) <= writable) {   /// 尾块就放得下，新块还回去
+        HasWritten(len);
+        BufferPool::Instance()->Free(extra, cap);
     }
-    else {
-        writePos_ = buffer_.size();      /// 可以写的指针移到了缓存区末尾
-        Append(buff, len - writable);    ///如果读到的大小大于缓存区剩余的空间，那么先扩容，再将没有放进去的数据放入缓存区中
+    else {   /// 新块接到链尾，数据不再拷贝
+        HasWritten(writable);
+        chain_.push_back(Block{ extra, cap, 0, len - writable });
+        readable_ += len - writable;
     }
     return len;    /// 返回读到的字节数
 }
@@ -140,33 +174,38 @@ ssize_t Buffer::WriteFd(int fd, int* saveErrno) {
     if(len < 0) {
         *saveErrno = errno;
         return len;
-    } 
-    readPos_ += len;
+    }
+    Retrieve(len);
     return len;
 }
 
-char* Buffer::BeginPtr_() {
-    return &*buffer_.begin();
+void Buffer::PushBlock_(size_t size) {
+    Block block = { nullptr, 0, 0, 0 };
+    block.data = BufferPool::Instance()->Allocate(size, &block.cap);
+    /// 尾块里没有未读的数据，直接换掉
+    if(!chain_.empty() && chain_.back().read == chain_.back().write) {
+        BufferPool::Instance()->Free(chain_.back().data, chain_.back().cap);
+        chain_.back() = block;
+        return;
+    }
+    chain_.push_back(block);
 }
 
-const char* Buffer::BeginPtr_() const {
-    return &*buffer_.begin();
+void Buffer::Pullup_() const {
+    Block block = { nullptr, 0, 0, 0 };
+    block.data = BufferPool::Instance()->Allocate(std::max(readable_, initSize_), &block.cap);
+    for(Block& old: chain_) {
+        memcpy(block.data + block.write, old.data + old.read, old.write - old.read);
+        block.write += old.write - old.read;
+        BufferPool::Instance()->Free(old.data, old.cap);
+    }
+    assert(block.write == readable_);
+    chain_.assign(1, block);
 }
 
-/// 扩容
-void Buffer::MakeSpace_(size_t len) {
-
-    /// 如果缓存区已经读完了的内存大小加上缓存区剩余内存的大小小于要写的长度，就在缓存区后面直接扩容
-    if(WritableBytes() + PrependableBytes() < len) {
-        /// 扩容，大小为writePos_ + len + 1 即已经写进去的字节数+扩容大小len
-        buffer_.resize(writePos_ + len + 1);
-    } 
-    else {
-        /// 如果缓存区已经读完了的内存大小加上缓存区剩余内存的大小大于等于要写的长度，就将还未读的数据移动到缓存区前面，然后更新写缓存区的指针
-        size_t readable = ReadableBytes();
-        std::copy(BeginPtr_() + readPos_, BeginPtr_() + writePos_, BeginPtr_());
-        readPos_ = 0;
-        writePos_ = readPos_ + readable;
-        assert(readable == ReadableBytes());
+void Buffer::ReleaseAll_() {
+    for(Block& block: chain_) {
+        BufferPool::Instance()->Free(block.data, block.cap);
     }
+    chain_.clear();
 }
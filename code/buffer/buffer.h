@@ -2,7 +2,7 @@
  * @Author       : mark
  * @Date         : 2020-06-26
  * @copyleft Apache 2.0
- */ 
+ */
 
 #ifndef BUFFER_H
 #define BUFFER_H
@@ -10,26 +10,36 @@
 #include <iostream>
 #include <unistd.h>  // write
 #include <sys/uio.h> //readv
-#include <vector> //readv
-#include <atomic>
+#include <vector>
+#include <algorithm>
 #include <assert.h>
+
+#include "bufferpool.h"
+
+/// 由内存块串起来的缓冲区，块从BufferPool取，数据读完就把块还回去，空闲的连接不占缓冲区内存
+/// 追加时尾块放不下就接一个新块，不搬移已有的数据；ReadFd直接读进尾块剩余的空间和一个新块，没有中转拷贝
+/// Peek()保证返回的可读数据是连续的：链上有多个块时先合并成一块（只有数据跨块时才发生）
 class Buffer {
 public:
-    /// 初始化buffer的大小为1024
+    /// initBuffSize 第一次追加时取的块的大小
     Buffer(int initBuffSize = 1024);
-    /// 禁止掉了默认的析构函数
-    ~Buffer() = default;
+    /// 把所有块还给BufferPool
+    ~Buffer();
 
-    /// 返回剩余可以写的字节数
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    /// 返回尾块剩余可以写的字节数
     size_t WritableBytes() const;
 
     /// 返回剩余可以读的字节数
     size_t ReadableBytes() const ;
 
-    /// 返回剩余可以读的字节的位置
+    /// 返回首块已经读过的字节数
     size_t PrependableBytes() const;
 
     const char* Peek() const;
+    /// 保证尾块有len字节连续的可写空间
     void EnsureWriteable(size_t len);
     void HasWritten(size_t len);
 
@@ -42,26 +52,39 @@ public:
     const char* BeginWriteConst() const;
     char* BeginWrite();
 
+    /// 一次Append的数据总在同一个块里，追加完可以用BeginWrite()往回改
     void Append(const std::string& str);
     void Append(const char* str, size_t len);
     void Append(const void* data, size_t len);
     void Append(const Buffer& buff);
 
-    /// 从fd中读数据，放入到缓存区中，若缓存区剩余大小不够，就触发扩容
+    /// 从fd中读数据，尾块剩余的空间不够时，多出来的数据直接留在新取的块里
     ssize_t ReadFd(int fd, int* Errno);
     ssize_t WriteFd(int fd, int* Errno);
 
+    /// 链上的块数（测试用）
+    size_t Blocks() const { return chain_.size(); }
+
+    /// ReadFd每次额外准备的块大小
+    static const size_t READ_BLOCK = 64 << 10;
+
 private:
-    char* BeginPtr_();                  /// 返回buffer缓冲区的头指针
-    const char* BeginPtr_() const;      /// 返回buffer缓冲区的头指针  const
-    void MakeSpace_(size_t len);
-
-    /// buffer缓冲区，这里利用了vector容器，方便可以动态的增加空间
-    std::vector<char> buffer_;
-    /// 原子操作，读指针的位置
-    std::atomic<std::size_t> readPos_;
-    /// 原子操作，写指针的位置
-    std::atomic<std::size_t> writePos_;
+    struct Block {
+        char* data;
+        size_t cap;
+        size_t read;        /// 读指针的位置
+        size_t write;       /// 写指针的位置
+    };
+
+    /// 把链上所有可读数据合并到一块连续的内存
+    void Pullup_() const;
+    void PushBlock_(size_t size);
+    void ReleaseAll_();
+
+    /// 合并发生在const的Peek()里，逻辑上内容不变
+    mutable std::vector<Block> chain_;
+    size_t readable_;
+    size_t initSize_;
 };
 
 #endif //BUFFER_H
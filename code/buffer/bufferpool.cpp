@@ -0,0 +1,121 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-26
+ * @copyleft Apache 2.0
+ */
+#include "bufferpool.h"
+
+#include <algorithm>
+
+/// 池对象不析构：Log等单例里的Buffer在程序退出时还会归还内存块
+BufferPool* BufferPool::Instance() {
+    static BufferPool* pool = new BufferPool();
+    return pool;
+}
+
+/// 不小于size的最小一级
+int BufferPool::Class_(size_t size) {
+    int cls = 0;
+    while((MIN_BLOCK << cls) < size) { cls++; }
+    return cls;
+}
+
+thread_local BufferPool::LocalCache BufferPool::local_;
+
+BufferPool::LocalCache::~LocalCache() {
+    for(int cls = 0; cls < CLASSES; cls++) {
+        BufferPool::Instance()->Flush_(cls, *this, 0);
+    }
+    closed = true;
+}
+
+size_t BufferPool::LocalLimit_(int cls) {
+    return std::max<size_t>(2, LOCAL_BYTES / (MIN_BLOCK << cls));
+}
+
+char* BufferPool::Allocate(size_t size, size_t* cap) {
+    assert(cap);
+    if(size > MAX_BLOCK) {
+        *cap = size;
+        return static_cast<char*>(::operator new(size));
+    }
+    int cls = Class_(size);
+    *cap = MIN_BLOCK << cls;
+    LocalCache& cache = local_;
+    if(!cache.head[cls]) { Refill_(cls, cache); }
+    if(cache.head[cls]) {
+        FreeBlock* block = cache.head[cls];
+        cache.head[cls] = block->next;
+        cache.count[cls]--;
+        return reinterpret_cast<char*>(block);
+    }
+    return static_cast<char*>(::operator new(*cap));
+}
+
+void BufferPool::Free(char* block, size_t cap) {
+    if(!block) { return; }
+    if(cap > MAX_BLOCK) {
+        ::operator delete(block);
+        return;
+    }
+    int cls = Class_(cap);
+    assert((MIN_BLOCK << cls) == cap);
+    LocalCache& cache = local_;
+    FreeBlock* free = reinterpret_cast<FreeBlock*>(block);
+    free->next = cache.head[cls];
+    cache.head[cls] = free;
+    cache.count[cls]++;
+    if(cache.closed) { Flush_(cls, cache, 0); }
+    else if(cache.count[cls] > LocalLimit_(cls)) { Flush_(cls, cache, LocalLimit_(cls) / 2); }
+}
+
+/// 从全局链表最多取BATCH块放进本地缓存
+void BufferPool::Refill_(int cls, LocalCache& cache) {
+    const size_t cap = MIN_BLOCK << cls;
+    FreeList& list = lists_[cls];
+    std::lock_guard<std::mutex> locker(list.mtx);
+    for(int i = 0; i < BATCH && list.head; i++) {
+        FreeBlock* block = list.head;
+        list.head = block->next;
+        list.bytes -= cap;
+        block->next = cache.head[cls];
+        cache.head[cls] = block;
+        cache.count[cls]++;
+    }
+}
+
+/// 本地缓存只留keep块，其余还给全局链表，全局链表也满了就释放
+void BufferPool::Flush_(int cls, LocalCache& cache, size_t keep) {
+    const size_t cap = MIN_BLOCK << cls;
+    FreeList& list = lists_[cls];
+    std::lock_guard<std::mutex> locker(list.mtx);
+    while(cache.count[cls] > keep) {
+        FreeBlock* block = cache.head[cls];
+        cache.head[cls] = block->next;
+        cache.count[cls]--;
+        if(list.bytes + cap <= MAX_FREE_BYTES) {
+            block->next = list.head;
+            list.head = block;
+            list.bytes += cap;
+        } else {
+            ::operator delete(block);
+        }
+    }
+}
+
+size_t BufferPool::FreeBytes() {
+    size_t bytes = 0;
+    for(FreeList& list: lists_) {
+        std::lock_guard<std::mutex> locker(list.mtx);
+        bytes += list.bytes;
+    }
+    return bytes;
+}
+
+size_t BufferPool::LocalBytes() {
+    size_t bytes = 0;
+    for(int cls = 0; cls < CLASSES; cls++) {
+        bytes += local_.count[cls] * (MIN_BLOCK << cls);
+    }
+    return bytes;
+}
@@ -0,0 +1,76 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-26
+ * @copyleft Apache 2.0
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <mutex>
+#include <new>
+#include <stddef.h>
+#include <assert.h>
+
+/// Buffer用的内存块池，单例模式
+/// 块大小按2的幂分级（MIN_BLOCK ~ MAX_BLOCK），每级一个空闲链表；块归还时挂回链表，不清零，
+/// 每级缓存的空闲块超过MAX_FREE_BYTES才真正释放；超过MAX_BLOCK的块直接new/delete
+/// 每个线程还有一层本地缓存，取还都先走本地，不加锁；本地空了从全局链表批量取，满了还一半回去
+class BufferPool {
+public:
+    static BufferPool* Instance();
+
+    /// 取一块不小于size的内存，cap带回块的实际大小
+    char* Allocate(size_t size, size_t* cap);
+
+    /// 归还Allocate取到的块，cap必须是Allocate带回的大小
+    void Free(char* block, size_t cap);
+
+    /// 全局链表里缓存的空闲块总字节数（不含各线程的本地缓存）
+    size_t FreeBytes();
+
+    /// 本线程本地缓存的空闲块总字节数
+    size_t LocalBytes();
+
+    static const size_t MIN_BLOCK = 1 << 10;
+    static const size_t MAX_BLOCK = 1 << 20;
+
+private:
+    BufferPool() = default;
+
+    static int Class_(size_t size);
+
+    static const int CLASSES = 11;                  /// 1KB, 2KB, ... 1MB
+    static const size_t MAX_FREE_BYTES = 4 << 20;
+    /// 每个线程每级本地缓存的上限（至少2块），和一次从全局链表取的块数
+    static const size_t LOCAL_BYTES = 256 << 10;
+    static const int BATCH = 8;
+
+    /// 空闲块的前几个字节用来串链表
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct FreeList {
+        std::mutex mtx;
+        FreeBlock* head = nullptr;
+        size_t bytes = 0;
+    };
+
+    /// 线程退出时本地缓存的块全部还给全局链表，之后这个线程归还的块直接进全局链表
+    struct LocalCache {
+        FreeBlock* head[CLASSES] = {};
+        size_t count[CLASSES] = {};
+        bool closed = false;
+        ~LocalCache();
+    };
+
+    static size_t LocalLimit_(int cls);
+    void Refill_(int cls, LocalCache& cache);
+    void Flush_(int cls, LocalCache& cache, size_t keep);
+
+    FreeList lists_[CLASSES];
+    static thread_local LocalCache local_;
+};
+
+#endif //BUFFER_POOL_H
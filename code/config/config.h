@@ -2,4 +2,73 @@
  * @Author       : mark
  * @Date         : 2020-06-28
  * @copyleft Apache 2.0
- */ 
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+/// 服务器的扩展配置，默认值保持原来的 单epoll主循环 + 一个线程池 的工作方式：不开额外的线程，也不丢弃任务
+/// main.cpp里是按部署调过的配置（分线程池、弹性扩容、任务截止时间）
+struct ServerConfig {
+    /// 子Reactor数量（one loop per thread），0表示不开启，由主线程epoll + 线程池处理所有连接
+    int subReactorNum = 0;
+
+    /// 开启SO_REUSEPORT；配合子Reactor时每个子Reactor有自己的监听socket，自己accept
+    /// 不开子Reactor时只是允许多个进程绑定同一端口
+    bool reusePort = false;
+
+    /// listen()的backlog，短连接风暴时太小会丢SYN
+    int listenBacklog = 1024;
+
+    /// 使用io_uring后端代替epoll（内核不支持时自动退回epoll）
+    bool useIoUring = false;
+
+    /// 静态文件映射缓存的总大小上限（字节），单个文件超过1/4不缓存
+    size_t fileCacheBytes = 64 << 20;
+
+    /// 缓存条目多久重新stat一次（毫秒），文件变化后最多这么久生效
+    int fileCacheCheckMS = 1000;
+
+    /// 不小于这个大小（字节）的文件用sendfile发送，不做mmap；0表示自动选择min(1MB, fileCacheBytes/4)
+    size_t sendfileThreshold = 0;
+
+    /// 大文件用sendfile发送；false时按固定大小的窗口分段mmap发送
+    bool useSendfile = true;
+
+    /// 不超过这个大小（字节）的文件，响应头和内容缓存成一块连续内存，一次send发完；0表示不缓存
+    size_t smallFileBytes = 8 << 10;
+
+    /// 磁盘IO线程数：写之前检查文件内容是否在页缓存里，不在时由这些线程预读，工作线程不阻塞；0表示不检查
+    int diskThreadNum = 0;
+
+    /// 数据库线程数：登录/注册的MySQL查询在这些线程里做，不占处理静态请求的线程；0表示在工作线程里直接查
+    int dbThreadNum = 0;
+
+    /// 大传输线程数：剩余待发送不小于bulkBytes的连接在这些线程里写；0表示都在工作线程里写
+    int bulkThreadNum = 0;
+    size_t bulkBytes = 1 << 20;
+
+    /// 连接亲和：同一个fd的事件总由同一个工作线程处理（不互相偷任务），连接的缓冲区和解析状态留在同一个CPU的缓存里
+    /// 关闭时同一个fd也优先交给同一个线程，但空闲线程会偷任务
+    bool workerAffinity = false;
+
+    /// 把静态请求和大传输的工作线程绑定到CPU上，一个线程一个CPU轮流分配
+    bool pinWorkers = false;
+
+    /// 弹性线程池：任务排队等待超过poolTargetWaitMS时临时加线程，工作线程（静态请求）最多到maxThreadNum，
+    /// 数据库线程最多到maxDbThreadNum；临时线程空闲poolIdleMS后退出；不大于常驻线程数时不扩容
+    int maxThreadNum = 0;
+    int maxDbThreadNum = 0;
+    int poolTargetWaitMS = 5;
+    int poolIdleMS = 30000;
+
+    /// 读请求和数据库任务在线程池里排队超过这么多毫秒就不再处理，直接关闭连接；0表示不过期
+    /// 过载时不把工作线程的时间花在客户端早已放弃的请求上；写任务是已经生成好的响应，不过期
+    int taskDeadlineMS = 0;
+
+    /// 每隔多少毫秒把各线程池的队列深度和等待时间写进日志，0表示不输出（需要开启超时，借用定时器）
+    int poolStatsMS = 10000;
+};
+
+#endif //CONFIG_H
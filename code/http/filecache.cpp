@@ -0,0 +1,336 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-27
+ * @copyleft Apache 2.0
+ */
+#include "filecache.h"
+
+#include <zlib.h>
+#include <brotli/encode.h>
+
+using namespace std;
+
+static const char* const ENCODING_SUFFIX[] = { "", ".gz", ".br" };
+
+FileCache::FileCache(): maxBytes_(64 << 20), maxFileBytes_(16 << 20), sendfileBytes_(1 << 20),
+                        checkInterval_(1000), bytes_(0), stop_(false) {}
+
+FileCache::~FileCache() {
+    {
+        lock_guard<mutex> locker(mtx_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if(compressor_.joinable()) { compressor_.join(); }
+}
+
+///  内部静态变量的懒汉单例（C++11 线程安全）
+FileCache* FileCache::Instance() {
+    static FileCache cache;
+    return &cache;
+}
+
+void FileCache::Init(size_t maxBytes, int checkMS, size_t sendfileBytes) {
+    lock_guard<mutex> locker(mtx_);
+    maxBytes_ = maxBytes;
+    maxFileBytes_ = maxBytes / 4;
+    /// 1MB以内的文件几次writev就能发完，映射常驻缓存里基本不会缺页；更大的文件缺页的代价超过了零拷贝映射的好处
+    sendfileBytes_ = sendfileBytes ? sendfileBytes : min<size_t>(1 << 20, maxFileBytes_);
+    checkInterval_ = chrono::milliseconds(checkMS);
+    Evict_();
+}
+
+/// 只有可读的普通文件才映射；MAP_PRIVATE 建立一个写入时拷贝的私有映射
+FilePtr FileCache::Map_(const string& path, const struct stat& st) const {
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+    file->st = st;
+    if(!(st.st_mode & S_IROTH) || st.st_size == 0) { return file; }
+    int fd = open(path.data(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) { return nullptr; }
+    /// 太大的文件从不整体映射，发送时sendfile或者分窗口映射
+    if(static_cast<size_t>(st.st_size) >= sendfileBytes_ || static_cast<size_t>(st.st_size) > maxFileBytes_) {
+        file->fd = fd;
+        return file;
+    }
+    void* ret = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(ret == MAP_FAILED) {
+        LOG_ERROR("mmap %s error: %d", path.data(), errno);
+        return nullptr;
+    }
+    file->data = static_cast<char*>(ret);
+    return file;
+}
+
+/// 条目占用的映射内存
+size_t FileCache::Cost_(const MappedFile& file) {
+    return file.data ? file.st.st_size : 0;
+}
+
+/// 一次性压缩到最高等级，结果常驻内存，多花的CPU只在第一次
+bool FileCache::Compress(const char* data, size_t len, Encoding encoding, vector<char>* out) {
+    if(encoding == ENCODING_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        /// windowBits 15 + 16 输出gzip格式
+        if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out->resize(deflateBound(&zs, len));
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = len;
+        zs.next_out = reinterpret_cast<Bytef*>(out->data());
+        zs.avail_out = out->size();
+        int ret = deflate(&zs, Z_FINISH);
+        out->resize(zs.total_out);
+        deflateEnd(&zs);
+        return ret == Z_STREAM_END;
+    }
+    if(encoding == ENCODING_BR) {
+        size_t outLen = BrotliEncoderMaxCompressedSize(len);
+        if(outLen == 0) { return false; }
+        out->resize(outLen);
+        if(!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len,
+                                  reinterpret_cast<const uint8_t*>(data), &outLen,
+                                  reinterpret_cast<uint8_t*>(out->data()))) {
+            return false;
+        }
+        out->resize(outLen);
+        return true;
+    }
+    return false;
+}
+
+bool FileCache::Resident(const MappedFile& file, size_t off, size_t len) {
+    if(len == 0 || !file.memory.empty()) { return true; }
+    if(file.data) {
+        static const size_t PAGE = sysconf(_SC_PAGESIZE);
+        size_t begin = off / PAGE * PAGE;
+        size_t pages = (off + len - begin + PAGE - 1) / PAGE;
+        unsigned char vec[64];
+        if(pages > sizeof(vec)) { pages = sizeof(vec); }    /// 只看开头的一段
+        if(mincore(file.data + begin, pages * PAGE, vec) < 0) { return true; }
+        for(size_t i = 0; i < pages; i++) {
+            if(!(vec[i] & 1)) { return false; }
+        }
+        return true;
+    }
+    if(file.fd >= 0) {
+        char c;
+        struct iovec iov = { &c, 1 };
+        /// 不在页缓存里时RWF_NOWAIT直接返回EAGAIN；文件系统不支持时返回别的错误，当作在
+        if(preadv2(file.fd, &iov, 1, off, RWF_NOWAIT) < 0 && errno == EAGAIN) { return false; }
+        if(len > 1 && preadv2(file.fd, &iov, 1, off + len - 1, RWF_NOWAIT) < 0 && errno == EAGAIN) { return false; }
+    }
+    return true;
+}
+
+void FileCache::Prefetch(const MappedFile& file, size_t off, size_t len) {
+    if(len == 0 || !file.memory.empty()) { return; }
+    if(file.data) {
+        static const size_t PAGE = sysconf(_SC_PAGESIZE);
+        size_t begin = off / PAGE * PAGE;
+        madvise(file.data + begin, off + len - begin, MADV_WILLNEED);
+        /// 逐页读一个字节，缺页发生在本线程
+        volatile char sum = 0;
+        for(size_t pos = begin; pos < off + len; pos += PAGE) { sum += file.data[pos]; }
+        (void)sum;
+    }
+    else if(file.fd >= 0) {
+        thread_local vector<char> scratch(256 << 10);
+        while(len > 0) {
+            ssize_t ret = pread(file.fd, scratch.data(), min(len, scratch.size()), off);
+            if(ret <= 0) { break; }
+            off += ret;
+            len -= ret;
+        }
+    }
+}
+
+bool FileCache::Same_(const struct stat& a, const struct stat& b) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+        && a.st_mode == b.st_mode && a.st_mtim.tv_sec == b.st_mtim.tv_sec
+        && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+FilePtr FileCache::Get(const string& path, bool map) {
+    FilePtr old;
+    {
+        lock_guard<mutex> locker(mtx_);
+        auto found = index_.find(path);
+        if(found != index_.end()) {
+            auto it = found->second;
+            lru_.splice(lru_.begin(), lru_, it);
+            if(Clock::now() - it->checked < checkInterval_) {
+                return it->file;        /// 命中且不需要校验，不产生任何系统调用
+            }
+            old = it->file;
+        }
+    }
+
+    /* 校验或首次加载，stat和mmap都在锁外做 */
+    struct stat st;
+    if(stat(path.data(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        lock_guard<mutex> locker(mtx_);
+        auto found = index_.find(path);
+        if(found != index_.end()) { Erase_(found->second); }
+        return nullptr;
+    }
+    if(old && Same_(old->st, st)) {
+        lock_guard<mutex> locker(mtx_);
+        auto found = index_.find(path);
+        if(found != index_.end() && found->second->file == old) { found->second->checked = Clock::now(); }
+        return old;
+    }
+    if(!map) {
+        shared_ptr<MappedFile> file = make_shared<MappedFile>();
+        file->st = st;
+        return file;
+    }
+    FilePtr file = Map_(path, st);
+    if(!file || Cost_(*file) > maxFileBytes_) {
+        return file;            /// 映射太大不缓存，这次请求单独使用
+    }
+
+    lock_guard<mutex> locker(mtx_);
+    auto found = index_.find(path);
+    if(found != index_.end()) {
+        /// 别的线程已经放进了同一个版本，用它的映射，这次的映射随file释放
+        if(Same_(found->second->file->st, st)) {
+            found->second->checked = Clock::now();
+            return found->second->file;
+        }
+        Erase_(found->second);
+    }
+    lru_.push_front(Entry{ path, file, Clock::now(), false, st, Cost_(*file) });
+    index_[path] = lru_.begin();
+    bytes_ += Cost_(*file);
+    Evict_();
+    return file;
+}
+
+FilePtr FileCache::GetEncoded(const string& path, const FilePtr& file, Encoding encoding, bool compressible) {
+    assert(file && encoding != ENCODING_IDENTITY);
+    const string key = path + ENCODING_SUFFIX[encoding];
+    {
+        lock_guard<mutex> locker(mtx_);
+        auto found = variants_.find(key);
+        if(found != variants_.end()) {
+            auto it = found->second;
+            if(Same_(it->source, file->st)) {
+                lru_.splice(lru_.begin(), lru_, it);
+                return it->file;
+            }
+            Erase_(it);             /// 原文件已经变了
+        }
+    }
+
+    /* 原文件的这个版本第一次请求压缩版本：先找预先压缩好的同名文件 */
+    FilePtr sibling = Get(key);
+    if(sibling && sibling->st.st_mtime >= file->st.st_mtime
+            && (sibling->st.st_mode & S_IROTH) && (sibling->data || sibling->fd >= 0)) {
+        PutVariant_(key, sibling, file->st, 0);   /// 映射已经算在同名文件自己的条目里
+        return sibling;
+    }
+
+    /// 只有stat结果（HEAD、条件请求）时还判断不了，不留记录
+    if(!file->data && file->fd < 0 && file->st.st_size > 0 && (file->st.st_mode & S_IROTH)) {
+        return nullptr;
+    }
+    /// 先放一个空条目，压缩好之前的请求直接发原文件，也不会重复提交压缩任务
+    PutVariant_(key, nullptr, file->st, 0);
+    if(compressible && (file->data || file->fd >= 0) && static_cast<size_t>(file->st.st_size) >= MIN_COMPRESS_BYTES
+            && static_cast<size_t>(file->st.st_size) <= maxFileBytes_) {
+        lock_guard<mutex> locker(mtx_);
+        if(!stop_) {
+            jobs_.push_back(Job{ key, file, encoding });
+            if(!compressor_.joinable()) { compressor_ = thread(&FileCache::CompressLoop_, this); }
+            cond_.notify_one();
+        }
+    }
+    return nullptr;
+}
+
+void FileCache::PutVariant_(const string& key, const FilePtr& file, const struct stat& source, size_t cost) {
+    lock_guard<mutex> locker(mtx_);
+    auto found = variants_.find(key);
+    if(found != variants_.end()) { Erase_(found->second); }
+    lru_.push_front(Entry{ key, file, Clock::now(), true, source, cost });
+    variants_[key] = lru_.begin();
+    bytes_ += cost;
+    Evict_();
+}
+
+/// 后台压缩线程：压缩好以后替换占位的空条目，原文件在这期间变了就丢弃结果
+void FileCache::CompressLoop_() {
+    unique_lock<mutex> locker(mtx_);
+    while(!stop_) {
+        if(jobs_.empty()) {
+            cond_.wait(locker);
+            continue;
+        }
+        Job job = move(jobs_.front());
+        jobs_.pop_front();
+        locker.unlock();
+
+        /// 走sendfile的文件没有映射，读到内存里再压缩
+        const char* data = job.file->data;
+        vector<char> content;
+        if(!data) {
+            content.resize(job.file->st.st_size);
+            ssize_t len = pread(job.file->fd, content.data(), content.size(), 0);
+            data = len == static_cast<ssize_t>(content.size()) ? content.data() : nullptr;
+        }
+        shared_ptr<MappedFile> encoded = make_shared<MappedFile>();
+        bool ok = data && Compress(data, job.file->st.st_size, job.encoding, &encoded->memory);
+        /// 压缩后没有小10%以上不值得，保留空条目，以后一直发原文件
+        ok = ok && encoded->memory.size() < static_cast<size_t>(job.file->st.st_size) * 9 / 10;
+        if(ok) {
+            encoded->st = job.file->st;
+            encoded->st.st_size = encoded->memory.size();
+            encoded->data = encoded->memory.data();
+        }
+
+        locker.lock();
+        auto found = variants_.find(job.key);
+        if(ok && found != variants_.end() && !found->second->file && Same_(found->second->source, job.file->st)) {
+            auto it = found->second;
+            it->file = encoded;
+            it->cost = encoded->memory.size();
+            bytes_ += it->cost;
+            Evict_();
+        }
+    }
+}
+
+void FileCache::Erase_(list<Entry>::iterator it) {
+    bytes_ -= it->cost;
+    if(it->variant) { variants_.erase(it->path); }
+    else { index_.erase(it->path); }
+    lru_.erase(it);
+}
+
+/// 超过上限时从表尾淘汰，正在发送的响应还持有映射，不受影响
+void FileCache::Evict_() {
+    while((bytes_ > maxBytes_ || lru_.size() > MAX_ENTRIES) && !lru_.empty()) {
+        Erase_(prev(lru_.end()));
+    }
+}
+
+void FileCache::Clear() {
+    lock_guard<mutex> locker(mtx_);
+    index_.clear();
+    variants_.clear();
+    lru_.clear();
+    bytes_ = 0;
+}
+
+size_t FileCache::Size() {
+    lock_guard<mutex> locker(mtx_);
+    return lru_.size();
+}
+
+size_t FileCache::Bytes() {
+    lock_guard<mutex> locker(mtx_);
+    return bytes_;
+}
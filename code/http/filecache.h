@@ -0,0 +1,141 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-27
+ * @copyleft Apache 2.0
+ */
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <list>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include <fcntl.h>       // open
+#include <unistd.h>      // close
+#include <sys/stat.h>    // stat
+#include <sys/mman.h>    // mmap, munmap, mincore
+#include <sys/uio.h>     // preadv2
+
+#include "../log/log.h"
+
+/// 一个文件的只读映射，最后一个引用释放时munmap
+/// 大文件不映射，只保留打开的fd，用sendfile发送，避免工作线程在缺页上阻塞、整个传输期间占着映射
+/// 压缩版本的内容放在memory里，data指向它
+struct MappedFile {
+    MappedFile(): data(nullptr), fd(-1), st() {}
+    ~MappedFile() {
+        if(data && memory.empty()) { munmap(data, st.st_size); }
+        if(fd >= 0) { close(fd); }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    char* data;             /// 空文件、没有读权限或走sendfile时为nullptr
+    int fd;                 /// 走sendfile的大文件的fd，sendfile带偏移量，多个连接共享同一个fd
+    struct stat st;         /// 压缩版本的st_size是压缩后的大小
+    std::vector<char> memory;
+};
+
+typedef std::shared_ptr<const MappedFile> FilePtr;
+
+/// 进程内共享的静态文件映射缓存，单例模式
+/// 按路径缓存stat结果和mmap映射区，并发的请求共享同一个映射；映射区用引用计数管理，
+/// 淘汰或文件变化时还在发送的响应继续持有旧映射，发完才释放
+/// 总映射大小超过上限时按LRU淘汰；每个条目最多checkMS毫秒重新stat一次，mtime、大小、inode变了就重新映射
+class FileCache {
+public:
+    /// 内容编码，请求头Accept-Encoding解析成 1 << ENCODING_xxx 的位集合
+    enum Encoding {
+        ENCODING_IDENTITY = 0,
+        ENCODING_GZIP,
+        ENCODING_BR,
+    };
+
+    static FileCache* Instance();
+
+    /// maxBytes 缓存的映射总大小上限，超过maxBytes/4的文件不映射进缓存；checkMS 重新校验的间隔
+    /// sendfileBytes 不小于这个大小的文件走sendfile，0表示自动：min(1MB, maxBytes/4)
+    void Init(size_t maxBytes, int checkMS, size_t sendfileBytes = 0);
+
+    /// 取路径对应的文件，不存在或是目录返回nullptr
+    /// map为false时只要stat结果（HEAD、条件请求）：缓存里有就用缓存的，没有只做stat，不映射也不放进缓存
+    FilePtr Get(const std::string& path, bool map = true);
+
+    /// 取file（path的当前版本）的压缩版本：优先用同目录下不比原文件旧的.br/.gz文件，
+    /// 否则compressible的文件第一次请求时交给后台线程压缩，压缩好之前和不值得压缩时返回nullptr
+    FilePtr GetEncoded(const std::string& path, const FilePtr& file, Encoding encoding, bool compressible);
+
+    void Clear();
+
+    size_t Size();
+    size_t Bytes();
+
+    /// 压缩，失败返回false（测试也会用到）
+    static bool Compress(const char* data, size_t len, Encoding encoding, std::vector<char>* out);
+
+    /// file的[off, off + len)是否在页缓存里，不会阻塞：映射区用mincore，fd用preadv2(RWF_NOWAIT)探测首尾两页
+    /// 内存里的内容和判断不了的情况都当作在
+    static bool Resident(const MappedFile& file, size_t off, size_t len);
+    /// 把[off, off + len)读进页缓存，会阻塞在磁盘IO上，只在磁盘IO线程里调用
+    static void Prefetch(const MappedFile& file, size_t off, size_t len);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        std::string path;
+        FilePtr file;                   /// 压缩版本的条目可以是nullptr，表示没有可用的压缩版本
+        Clock::time_point checked;      /// 上一次stat的时间
+        bool variant;                   /// 是否是压缩版本，在variants_里索引
+        struct stat source;             /// 压缩版本对应的原文件，原文件变了就作废
+        size_t cost;                    /// 占用的内存
+    };
+
+    struct Job {
+        std::string key;
+        FilePtr file;
+        Encoding encoding;
+    };
+
+    FileCache();
+    ~FileCache();
+
+    /// 缓存条目数上限，走sendfile的条目不占映射内存，靠它限制打开的fd数量
+    static const size_t MAX_ENTRIES = 1024;
+    /// 太小的文件压缩没有意义
+    static const size_t MIN_COMPRESS_BYTES = 256;
+
+    FilePtr Map_(const std::string& path, const struct stat& st) const;
+    static size_t Cost_(const MappedFile& file);
+    static bool Same_(const struct stat& a, const struct stat& b);
+
+    void Erase_(std::list<Entry>::iterator it);
+    void Evict_();
+    void PutVariant_(const std::string& key, const FilePtr& file, const struct stat& source, size_t cost);
+    void CompressLoop_();
+
+    size_t maxBytes_;
+    size_t maxFileBytes_;
+    size_t sendfileBytes_;
+    std::chrono::milliseconds checkInterval_;
+    size_t bytes_;
+
+    std::list<Entry> lru_;      /// 表头是最近使用的
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> variants_;  /// 键是 路径 + 后缀(.gz/.br)
+    std::mutex mtx_;
+
+    /* 后台压缩线程，第一次有压缩任务时启动 */
+    std::deque<Job> jobs_;
+    std::condition_variable cond_;
+    std::thread compressor_;
+    bool stop_;
+};
+
+#endif //FILE_CACHE_H
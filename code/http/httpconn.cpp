@@ -9,11 +9,22 @@ using namespace std;
 const char* HttpConn::srcDir;
 std::atomic<int> HttpConn::userCount;
 bool HttpConn::isET;
+bool HttpConn::useSendfile = true;
+bool HttpConn::checkResident = false;
 
 HttpConn::HttpConn() { 
     fd_ = -1;
     addr_ = { 0 };
     isClose_ = true;
+    toWrite_ = 0;
+    keepAlive_ = true;
+    verifyPending_ = false;
+    sendfileOk_ = true;
+    window_ = nullptr;
+    windowOff_ = windowLen_ = 0;
+    cold_ = false;
+    prefetched_ = nullptr;
+    prefetchedPos_ = 0;
 };
 
 HttpConn::~HttpConn() { 
@@ -30,8 +41,15 @@ void HttpConn::init(int fd, const sockaddr_in& addr) {
     /// 用户连接在本系统中的文件描述符
     fd_ = fd;
     /// 读写缓冲区初始化
+    ClearReplies_();
     writeBuff_.RetrieveAll();
     readBuff_.RetrieveAll();
+    request_.Init();
+    keepAlive_ = true;
+    verifyPending_ = false;
+    sendfileOk_ = true;
+    cold_ = false;
+    prefetched_ = nullptr;
     isClose_ = false;
     LOG_INFO("Client[%d](%s:%d) in, userCount:%d", fd_, GetIP(), GetPort(), (int)userCount);
 }
@@ -39,6 +57,7 @@ void HttpConn::init(int fd, const sockaddr_in& addr) {
 /// 关闭此客户端连接，释放内存映射区的资源，关闭客户端的文件描述符
 void HttpConn::Close() {
     response_.UnmapFile();
+    ClearReplies_();
     if(isClose_ == false){
         isClose_ = true; 
         userCount--;
@@ -75,59 +94,239 @@ ssize_t HttpConn::read(int* saveErrno) {
     return len;
 }
 
+/// 一次sendmsg（相当于writev）把队列里所有已经生成好的响应按顺序发出去，大文件的内容用sendfile发
 ssize_t HttpConn::write(int* saveErrno) {
     ssize_t len = -1;
     do {
-        len = writev(fd_, iov_, iovCnt_);
+        if(checkResident && !Resident_()) {
+            *saveErrno = EAGAIN;
+            return -1;
+        }
+        bool direct = useSendfile && sendfileOk_ && !replies_.empty() && replies_.front().headLen == 0
+                && replies_.front().file && replies_.front().file->fd >= 0;
+        if(direct) {
+            len = SendFile_();
+            if(len < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                sendfileOk_ = direct = false;   /// 这个socket不支持sendfile，改用映射窗口
+            }
+        }
+        if(!direct) {
+            /// 后面紧跟着sendfile时带上MSG_MORE，响应头和文件内容合并成满的报文段，不会被Nagle和延迟确认卡住
+            bool more = false;
+            struct msghdr msg = {};
+            msg.msg_iov = iov_;
+            msg.msg_iovlen = FillIov_(&more);
+            if(msg.msg_iovlen == 0) {
+                *saveErrno = errno;     /// 映射窗口失败
+                return -1;
+            }
+            len = sendmsg(fd_, &msg, more ? MSG_MORE | MSG_NOSIGNAL : MSG_NOSIGNAL);
+        }
         if(len <= 0) {
             *saveErrno = errno;
             break;
         }
-        if(iov_[0].iov_len + iov_[1].iov_len  == 0) { break; } /* 传输结束 */
-        else if(static_cast<size_t>(len) > iov_[0].iov_len) {
-            iov_[1].iov_base = (uint8_t*) iov_[1].iov_base + (len - iov_[0].iov_len);
-            iov_[1].iov_len -= (len - iov_[0].iov_len);
-            if(iov_[0].iov_len) {
-                writeBuff_.RetrieveAll();
-                iov_[0].iov_len = 0;
+        Advance_(len);
+        if(toWrite_ == 0) { break; } /* 传输结束 */
+    } while(isET || ToWriteBytes() > 10240);
+    return len;
+}
+
+bool HttpConn::Resident_() {
+    if(replies_.empty()) { return true; }
+    const Reply& reply = replies_.front();
+    if(!reply.file || reply.fileSent >= reply.fileLen) { return true; }
+    size_t pos = reply.fileOff + reply.fileSent;
+    if(reply.file.get() == prefetched_ && pos == prefetchedPos_) { return true; }
+    if(FileCache::Resident(*reply.file, pos, min(RESIDENT_CHECK_BYTES, reply.fileLen - reply.fileSent))) {
+        return true;
+    }
+    LOG_DEBUG("Client[%d] cold file at %zu", fd_, pos);
+    cold_ = true;
+    return false;
+}
+
+std::function<void()> HttpConn::TakePrefetch() {
+    assert(cold_ && !replies_.empty());
+    cold_ = false;
+    const Reply& reply = replies_.front();
+    FilePtr file = reply.file;
+    size_t pos = reply.fileOff + reply.fileSent;
+    size_t len = min(PREFETCH_BYTES, reply.fileLen - reply.fileSent);
+    prefetched_ = file.get();
+    prefetchedPos_ = pos;
+    return [file, pos, len]() { FileCache::Prefetch(*file, pos, len); };
+}
+
+void HttpConn::Received(const char* data, size_t len) {
+    readBuff_.Append(data, len);
+}
+
+int HttpConn::FillSend(const struct iovec** iov, std::shared_ptr<const void>* owners, bool* more) {
+    if(checkResident && !Resident_()) { return -1; }
+    *iov = iov_;
+    return FillIov_(more, owners);
+}
+
+int HttpConn::FillIov_(bool* more, std::shared_ptr<const void>* owners) {
+    int cnt = 0;
+    const char* head = writeBuff_.Peek();
+    for(const Reply& reply: replies_) {
+        if(cnt + 2 > MAX_IOV) { break; }
+        if(reply.headLen) {
+            iov_[cnt].iov_base = const_cast<char*>(head);
+            iov_[cnt].iov_len = reply.headLen;
+            if(owners) { owners[cnt] = nullptr; }
+            head += reply.headLen;
+            cnt++;
+        }
+        if(reply.file && reply.file->fd >= 0) {
+            /// 没有整体映射的大文件：sendfile发送，或者只有队首的响应用映射窗口发送
+            *more = true;
+            if(!(useSendfile && sendfileOk_) && cnt == 0 && !owners) {
+                size_t avail = 0;
+                char* data = MapWindow_(reply, &avail);
+                if(data) {
+                    iov_[cnt].iov_base = data;
+                    iov_[cnt].iov_len = avail;
+                    cnt++;
+                    *more = avail < reply.fileLen - reply.fileSent;
+                }
             }
+            break;
         }
-        else {
-            iov_[0].iov_base = (uint8_t*)iov_[0].iov_base + len; 
-            iov_[0].iov_len -= len; 
-            writeBuff_.Retrieve(len);
+        if(reply.fileSent < reply.fileLen) {
+            iov_[cnt].iov_base = reply.file->data + reply.fileOff + reply.fileSent;
+            iov_[cnt].iov_len = reply.fileLen - reply.fileSent;
+            if(owners) { owners[cnt] = reply.file; }
+            cnt++;
         }
-    } while(isET || ToWriteBytes() > 10240);
+    }
+    return cnt;
+}
+
+ssize_t HttpConn::SendFile_() {
+    const Reply& reply = replies_.front();
+    off_t offset = reply.fileOff + reply.fileSent;
+    ssize_t len = sendfile(fd_, reply.file->fd, &offset, reply.fileLen - reply.fileSent);
+    if(len == 0) { errno = EIO; }   /// 文件在发送过程中被截短了
     return len;
 }
 
-/// 客户端数据处理类
-bool HttpConn::process() {
-    /// 请求头初始化
-    request_.Init();
-    /// 如果客户端数据小于等于0，返回false
-    if(readBuff_.ReadableBytes() <= 0) {
-        return false;
+/// 保证窗口覆盖队首响应的当前发送位置，返回该位置的地址，avail带回窗口里还能发送的字节数
+/// 窗口按页对齐，最大WINDOW_SIZE，madvise顺序读让内核预读、及时回收已经发过的页
+char* HttpConn::MapWindow_(const Reply& reply, size_t* avail) {
+    size_t pos = reply.fileOff + reply.fileSent;
+    size_t end = reply.fileOff + reply.fileLen;
+    if(!window_ || pos < windowOff_ || pos >= windowOff_ + windowLen_) {
+        UnmapWindow_();
+        static const size_t PAGE = sysconf(_SC_PAGESIZE);
+        size_t off = pos / PAGE * PAGE;
+        size_t len = std::min(WINDOW_SIZE, end - off);
+        void* ret = mmap(nullptr, len, PROT_READ, MAP_SHARED, reply.file->fd, off);
+        if(ret == MAP_FAILED) {
+            LOG_ERROR("Client[%d] map window error: %d", fd_, errno);
+            return nullptr;
+        }
+        madvise(ret, len, MADV_SEQUENTIAL);
+        window_ = static_cast<char*>(ret);
+        windowOff_ = off;
+        windowLen_ = len;
+    }
+    *avail = std::min(windowOff_ + windowLen_, end) - pos;
+    return window_ + (pos - windowOff_);
+}
+
+void HttpConn::UnmapWindow_() {
+    if(window_) {
+        munmap(window_, windowLen_);
+        window_ = nullptr;
+        windowOff_ = windowLen_ = 0;
     }
-    else if(request_.parse(readBuff_)) {  /// request_.parse(readBuff_) 解析请求头
-        LOG_DEBUG("%s", request_.path().c_str());  /// 解析成功
-        response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200);
-    } else {   /// 解析失败
-        response_.Init(srcDir, request_.path(), false, 400);
+}
+
+void HttpConn::Advance_(size_t len) {
+    toWrite_ -= len;
+    while(!replies_.empty()) {
+        Reply& reply = replies_.front();
+        size_t n = std::min(len, reply.headLen);
+        writeBuff_.Retrieve(n);
+        reply.headLen -= n;
+        len -= n;
+        n = std::min(len, reply.fileLen - reply.fileSent);
+        reply.fileSent += n;
+        len -= n;
+        if(reply.headLen || reply.fileSent < reply.fileLen) { break; }
+        UnmapWindow_();     /// 窗口只属于队首的响应
+        replies_.pop_front();
     }
+}
 
-    response_.MakeResponse(writeBuff_);
-    /* 响应头 */
-    iov_[0].iov_base = const_cast<char*>(writeBuff_.Peek());
-    iov_[0].iov_len = writeBuff_.ReadableBytes();
-    iovCnt_ = 1;
-
-    /* 文件 */
-    if(response_.FileLen() > 0  && response_.File()) {
-        iov_[1].iov_base = response_.File();
-        iov_[1].iov_len = response_.FileLen();
-        iovCnt_ = 2;
+void HttpConn::ClearReplies_() {
+    UnmapWindow_();
+    replies_.clear();
+    toWrite_ = 0;
+}
+
+/// 客户端数据处理类
+bool HttpConn::process(bool deferVerify) {
+    /// 上一个响应是Connection: close，后面的请求不再处理
+    while(keepAlive_ && replies_.size() < MAX_PIPELINE && (verifyPending_ || readBuff_.ReadableBytes() > 0)) {
+        HttpRequest::HTTP_CODE ret = HttpRequest::GET_REQUEST;
+        if(!verifyPending_) {
+            /// 解析请求，不完整的请求保留解析进度，等下次读到更多数据再继续
+            ret = request_.parse(readBuff_);
+            if(ret == HttpRequest::NO_REQUEST) {
+                break;
+            }
+            verifyPending_ = ret == HttpRequest::GET_REQUEST && request_.NeedsVerify();
+        }
+        if(verifyPending_) {
+            /// 要查数据库的请求停在这里，请求的数据还留在读缓冲区；前面排队的响应照常发送
+            if(deferVerify) { break; }
+            request_.Verify();
+            verifyPending_ = false;
+        }
+        if(ret == HttpRequest::GET_REQUEST) {  /// 解析成功
+            LOG_DEBUG("%.*s", (int)request_.path().size(), request_.path().data());
+            response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200,
+                           HttpResponse::ParseAcceptEncoding(request_.GetHeader("Accept-Encoding")));
+            response_.SetConditional(request_.method() == "HEAD", request_.GetHeader("If-None-Match"),
+                                     request_.GetHeader("If-Modified-Since"));
+            if(request_.method() == "GET") {
+                response_.SetRange(request_.GetHeader("Range"), request_.GetHeader("If-Range"));
+            }
+        } else {   /// 解析失败
+            response_.Init(srcDir, request_.path(), false, 400);
+        }
+        keepAlive_ = request_.IsKeepAlive() && ret == HttpRequest::GET_REQUEST;
+
+        /* 响应头追加在writeBuff_末尾，文件映射区交给发送队列 */
+        size_t before = writeBuff_.ReadableBytes();
+        response_.MakeResponse(writeBuff_);
+        /// 响应已经生成，请求占用的字节可以从读缓冲区取走了
+        request_.Consume(readBuff_);
+        FilePtr file;
+        if(response_.FileLen() > 0) { file = response_.DetachFile(); }
+        for(size_t i = 0; file && i < response_.Parts(); i++) {
+            Reply reply = { writeBuff_.ReadableBytes() - before, file, response_.Part(i).first,
+                            response_.Part(i).second, 0 };
+            toWrite_ += reply.headLen + reply.fileLen;
+            replies_.push_back(std::move(reply));
+            before = writeBuff_.ReadableBytes();
+            response_.AddPartBoundary(writeBuff_, i);
+        }
+        if(writeBuff_.ReadableBytes() > before || !file) {
+            Reply reply = { writeBuff_.ReadableBytes() - before, nullptr, 0, 0, 0 };
+            toWrite_ += reply.headLen;
+            replies_.push_back(std::move(reply));
+        }
+        LOG_DEBUG("parts:%zu, %zu replies to %zu", response_.Parts(), replies_.size(), ToWriteBytes());
+    }
+    /// 读到的数据都处理完了，连接接下来多半是空闲等待，先把响应占的堆内存还回去（请求本身不占堆内存）；
+    /// 读写缓冲区的块在数据取完时已经还给BufferPool，下次EPOLLIN读数据时再取
+    if(readBuff_.ReadableBytes() == 0 && !verifyPending_) {
+        response_.Trim();
     }
-    LOG_DEBUG("filesize:%d, %d  to %d", response_.FileLen() , iovCnt_, ToWriteBytes());
-    return true;
+    return toWrite_ > 0;
 }
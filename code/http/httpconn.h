@@ -9,9 +9,16 @@
 
 #include <sys/types.h>
 #include <sys/uio.h>     // readv/writev
+#include <sys/socket.h>  // sendmsg
 #include <arpa/inet.h>   // sockaddr_in
 #include <stdlib.h>      // atoi()
 #include <errno.h>      
+#include <atomic>
+#include <sys/sendfile.h>
+#include <sys/mman.h>    // mmap, madvise
+#include <algorithm>
+#include <list>
+#include <functional>
 
 #include "../log/log.h"
 #include "../pool/sqlconnRAII.h"
@@ -46,31 +53,105 @@ public:
     /// 获取用户连接的地址信息
     sockaddr_in GetAddr() const;
     
-    bool process();
+    /// 解析读缓冲区里所有完整的请求（流水线），按顺序把响应排进发送队列，有响应要发返回true
+    /// deferVerify为true时遇到要查数据库的请求就停下，WaitingVerify()为true，
+    /// 调用者在数据库线程里再调用process(false)完成校验并继续处理后面的请求
+    bool process(bool deferVerify = false);
+
+    /// 有一个已经解析完、等着查数据库的请求
+    bool WaitingVerify() const {
+        return verifyPending_;
+    }
 
-    int ToWriteBytes() { 
-        return iov_[0].iov_len + iov_[1].iov_len; 
+    size_t ToWriteBytes() const {
+        return toWrite_;
     }
 
+    /// 已经排队的响应里有Connection: close时为false，发完就关闭连接
     bool IsKeepAlive() const {
-        return request_.IsKeepAlive();
+        return keepAlive_;
+    }
+
+    /// write()发现队首文件接下来的内容不在页缓存里时停下，返回-1、errno为EAGAIN，IsCold()为true
+    /// 调用者把TakePrefetch()交给磁盘IO线程，读进页缓存后再关注EPOLLOUT，工作线程不会阻塞在缺页上
+    bool IsCold() const {
+        return cold_;
+    }
+
+    /// 返回预读任务，只持有文件的引用，不访问连接对象，连接在这期间关闭也没关系
+    std::function<void()> TakePrefetch();
+
+    /* io_uring完成模式：收发由内核完成，这里只记账 */
+
+    /// 内核收到的数据，追加进读缓冲区
+    void Received(const char* data, size_t len);
+
+    /// 准备一次发送：iov指向发送队列里的数据，owners[i]是第i段内存的持有者（文件），为空表示在写缓冲区里，提交前要复制
+    /// 返回段数；文件内容不在页缓存里时返回-1，IsCold()为true；队首响应要走sendfile或映射窗口时返回0，改用write()发送
+    int FillSend(const struct iovec** iov, std::shared_ptr<const void>* owners, bool* more);
+
+    /// 内核发出了len字节
+    void Sent(size_t len) {
+        Advance_(len);
     }
 
+    /// 读缓冲区里还有没处理的请求数据
+    bool HasBufferedInput() const {
+        return readBuff_.ReadableBytes() > 0 || verifyPending_;
+    }
+
+    /// 一个连接上最多排队的响应数，剩下的请求留在读缓冲区，等这一批发完再处理
+    static const size_t MAX_PIPELINE = 16;
+
+    /// 一次发送最多的段数
+    static const int MAX_IOV = 2 * MAX_PIPELINE;
+
+    /// 不用sendfile时大文件每次最多映射这么大的窗口，每个传输占用的内存和文件大小无关
+    static const size_t WINDOW_SIZE = 4 << 20;
+
+    /// 每次写之前检查页缓存的范围，和一次预读的大小
+    static const size_t RESIDENT_CHECK_BYTES = 256 << 10;
+    static const size_t PREFETCH_BYTES = 2 << 20;
+
     static bool isET;
+    /// 大文件用sendfile发送；关掉时（或socket不支持sendfile时）用映射窗口发送
+    static bool useSendfile;
+    /// 写之前检查文件内容是否在页缓存里（有磁盘IO线程时打开）
+    static bool checkResident;
     static const char* srcDir;
 
     /// C++11新特性，原子类型，描述用户连接的数量
     static std::atomic<int> userCount;
     
 private:
-   
+    /// 发送队列里的一个响应：响应头（和错误页）在writeBuff_里按顺序首尾相接，文件是各自的映射区
+    /// multipart范围响应拆成多项：每项是一段文本加一个文件片段，最后一项只有结束分隔符
+    struct Reply {
+        size_t headLen;     /// writeBuff_里还没发的响应头字节数
+        FilePtr file;       /// 文件缓存里的映射区，发完后释放引用
+        size_t fileOff;     /// 要发送的文件片段，范围请求时只是文件的一部分
+        size_t fileLen;
+        size_t fileSent;
+    };
+
+    /// 用发送队列填充iov_，返回iovec个数；遇到走sendfile的响应，只填到它的响应头为止，more置为true
+    /// owners不为空时记下每段内存的持有者，并且不映射窗口（窗口属于连接，不能交给内核异步发送）
+    int FillIov_(bool* more, std::shared_ptr<const void>* owners = nullptr);
+    /// 队首响应头已经发完、文件走sendfile时，直接从文件fd发送
+    ssize_t SendFile_();
+    char* MapWindow_(const Reply& reply, size_t* avail);
+    void UnmapWindow_();
+    /// 队首响应接下来要发送的文件内容是否在页缓存里，不在时置cold_
+    bool Resident_();
+    /// writev写出len字节后推进发送队列，发完的响应出队
+    void Advance_(size_t len);
+    void ClearReplies_();
+
     int fd_;
     struct  sockaddr_in addr_;
 
     bool isClose_;
     
-    int iovCnt_;
-
     /**
      * struct iovec {
             void  *iov_base;    // Starting address (内存起始地址）
@@ -81,7 +162,22 @@ private:
         iovec 结构体的字段 iov_base 指向一个缓冲区，这个缓冲区存放的是网络接收的数据（read），或者网络将要发送的数据（write）。
         iovec 结构体的字段 iov_len 存放的是接收数据的最大长度（read），或者实际写入的数据长度（write）
     */
-    struct iovec iov_[2];
+    struct iovec iov_[MAX_IOV];
+
+    /// 按请求顺序排队等待发送的响应；用list是因为空的deque也占着几百字节，空闲连接多时不划算
+    std::list<Reply> replies_;
+    size_t toWrite_;                /// 发送队列里剩余的总字节数
+    bool keepAlive_;
+    bool verifyPending_;
+    bool sendfileOk_;
+
+    char* window_;                  /// 队首大文件当前的映射窗口
+    size_t windowOff_;              /// 窗口在文件里的偏移（页对齐）
+    size_t windowLen_;
+
+    bool cold_;
+    const MappedFile* prefetched_;  /// 上一次预读的文件和位置，预读回来后先发送，不再检查，保证有进展
+    size_t prefetchedPos_;
     
     Buffer readBuff_; // 读缓冲区
     Buffer writeBuff_; // 写缓冲区
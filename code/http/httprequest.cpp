@@ -16,78 +16,140 @@ const unordered_map<string, int> HttpRequest::DEFAULT_HTML_TAG {
 
 /// 请求头初始化
 void HttpRequest::Init() {
-    method_ = path_ = version_ = body_ = "";
     state_ = REQUEST_LINE;
-    header_.clear();
-    post_.clear();
+    base_ = nullptr;
+    parsed_ = scanned_ = contentLen_ = 0;
+    method_ = uri_ = version_ = Span{0, 0};
+    headerCnt_ = 0;
+    isKeepAlive_ = false;
+    verifyTag_ = -1;
+    path_ = body_ = Span{0, 0};
+    isForm_ = false;
+    rewriteLen_ = 0;
 }
 
 /// 是否是http1.1 的长连接
 bool HttpRequest::IsKeepAlive() const {
-    if(header_.count("Connection") == 1) {
-        return header_.find("Connection")->second == "keep-alive" && version_ == "1.1";
-    }
-    return false;
+    return isKeepAlive_;
 }
 
-bool HttpRequest::parse(Buffer& buff) {
-    const char CRLF[] = "\r\n";
-    if(buff.ReadableBytes() <= 0) {  /// 请求头资源为空，返回错误
-        return false;
+HttpRequest::HTTP_CODE HttpRequest::parse(Buffer& buff) {
+    if(state_ == FINISH) {   /// 上一个请求已经处理完，开始解析下一个
+        Init();
+    }
+    if(buff.ReadableBytes() <= 0) {
+        return NO_REQUEST;
     }
+    const char* begin = buff.Peek();
+    const char* end = begin + buff.ReadableBytes();
+    base_ = begin;
 
     /// 状态机，分三部分解析，REQUEST_LINE、HEADERS、BODY
-    while(buff.ReadableBytes() && state_ != FINISH) {
-        const char* lineEnd = search(buff.Peek(), buff.BeginWriteConst(), CRLF, CRLF + 2);
-        std::string line(buff.Peek(), lineEnd);  /// 截取字符串
+    while(state_ != FINISH) {
+        if(state_ == BODY) {
+            if(static_cast<size_t>(end - begin) < parsed_ + contentLen_) {
+                return NO_REQUEST;              /// body还没收全
+            }
+            ParseBody_(std::string_view(begin + parsed_, contentLen_));
+            parsed_ += contentLen_;
+            break;
+        }
+        const char* lineBegin = begin + parsed_;
+        const char* lineEnd = HttpScan::FindCRLF(begin + std::max(parsed_, scanned_), end);
+        if(!lineEnd) {
+            scanned_ = (end - begin) > 0 ? (end - begin) - 1 : 0;  /// 末尾可能是半个CRLF，留一个字节
+            if(static_cast<size_t>(end - begin) > MAX_HEAD_SIZE) {
+                LOG_ERROR("Request head too large");
+                break;
+            }
+            return NO_REQUEST;
+        }
+        bool ok = true;
         switch(state_)
         {
         case REQUEST_LINE:                  /// 资源访问请求  默认
-            if(!ParseRequestLine_(line)) { /// 如果截取的字符串为空，则返回错误
-                return false;
-            }
-            ParsePath_();                   /// 定位到要访问的资源目录
-            break;    
+            ok = ParseRequestLine_(lineBegin, lineEnd);
+            break;
         case HEADERS:
-            ParseHeader_(line);             /// 解析http请求头,并改变状态为body
-            if(buff.ReadableBytes() <= 2) { /// 如果剩余的请求资源字节数少于2个，说明没有body，直接改变状态为finish
-                state_ = FINISH;
+            if(lineBegin == lineEnd) {      /// 空行，请求头结束，有Content-Length才有body
+                state_ = contentLen_ > 0 ? BODY : FINISH;
+            } else {
+                ok = ParseHeader_(lineBegin, lineEnd);
             }
             break;
-        case BODY:                          ///解析body
-            ParseBody_(line);
-            break;
         default:
             break;
         }
-        if(lineEnd == buff.BeginWrite()) { break; }
-        buff.RetrieveUntil(lineEnd + 2);
+        if(!ok) { break; }
+        parsed_ = lineEnd + 2 - begin;
     }
-    LOG_DEBUG("[%s], [%s], [%s]", method_.c_str(), path_.c_str(), version_.c_str());
-    return true;
+    return Finish_();
+}
+
+/// 一个请求解析结束（成功或失败），整理出后面要用的结果
+HttpRequest::HTTP_CODE HttpRequest::Finish_() {
+    if(state_ != FINISH && state_ != BODY) {
+        /// 格式错误，这个连接上剩下的数据都丢弃
+        state_ = FINISH;
+        parsed_ = SIZE_MAX;
+        isKeepAlive_ = false;
+        return BAD_REQUEST;
+    }
+    state_ = FINISH;
+    std::string_view connection = GetHeader("Connection");
+    isKeepAlive_ = connection.size() == 10 && strncasecmp(connection.data(), "keep-alive", 10) == 0
+                   && version() == "1.1";
+    std::string_view uri = View_(uri_);
+    path_ = Span{uri_.off, static_cast<uint32_t>(uri.substr(0, uri.find('?')).size())};
+    ParsePath_();                   /// 定位到要访问的资源目录
+    ParsePost_();
+    LOG_DEBUG("[%.*s], [%.*s], [%.*s]", (int)method_.len, base_ + method_.off, (int)path().size(), path().data(),
+              (int)version_.len, base_ + version_.off);
+    return GET_REQUEST;
+}
+
+void HttpRequest::Consume(Buffer& buff) {
+    if(parsed_ >= buff.ReadableBytes()) {
+        buff.RetrieveAll();
+    } else {
+        buff.Retrieve(parsed_);
+    }
+    base_ = nullptr;
 }
 
 void HttpRequest::ParsePath_() {
-    if(path_ == "/") {
-        path_ = "/index.html"; 
+    std::string_view path = View_(path_);
+    if(path == "/") {
+        Rewrite_("/index.html");
     }
     else {
         for(auto &item: DEFAULT_HTML) {
-            if(item == path_) {
-                path_ += ".html";
+            if(item == path) {
+                Rewrite_(path, ".html");
                 break;
             }
         }
     }
 }
 
-bool HttpRequest::ParseRequestLine_(const string& line) {
-    regex patten("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");
-    smatch subMatch;
-    if(regex_match(line, subMatch, patten)) {   
-        method_ = subMatch[1];
-        path_ = subMatch[2];
-        version_ = subMatch[3];
+/// 改写后的path放进对象内的数组，不分配内存；会改写成的path都很短
+void HttpRequest::Rewrite_(std::string_view path, std::string_view suffix) {
+    assert(path.size() + suffix.size() <= MAX_REWRITE);
+    memcpy(rewrite_, path.data(), path.size());
+    memcpy(rewrite_ + path.size(), suffix.data(), suffix.size());
+    rewriteLen_ = path.size() + suffix.size();
+}
+
+/// 请求行：METHOD SP URI SP HTTP/VERSION，方法名必须是token
+bool HttpRequest::ParseRequestLine_(const char* begin, const char* end) {
+    const char* sp1 = HttpScan::ScanToken(begin, end);
+    if(sp1 == end || *sp1 != ' ') { sp1 = nullptr; }
+    const char* sp2 = sp1 ? static_cast<const char*>(memchr(sp1 + 1, ' ', end - sp1 - 1)) : nullptr;
+    if(sp1 && sp2 && sp1 > begin && sp2 > sp1 + 1 && end - sp2 > 6
+            && memcmp(sp2 + 1, "HTTP/", 5) == 0 && !memchr(sp2 + 6, ' ', end - sp2 - 6)) {
+        method_ = Span{static_cast<uint32_t>(begin - base_), static_cast<uint32_t>(sp1 - begin)};
+        uri_ = Span{static_cast<uint32_t>(sp1 + 1 - base_), static_cast<uint32_t>(sp2 - sp1 - 1)};
+        version_ = Span{static_cast<uint32_t>(sp2 + 6 - base_), static_cast<uint32_t>(end - sp2 - 6)};
         state_ = HEADERS;
         return true;
     }
@@ -95,24 +157,51 @@ bool HttpRequest::ParseRequestLine_(const string& line) {
     return false;
 }
 
-/// 利用正则存储匹配body参数
-void HttpRequest::ParseHeader_(const string& line) {
-    regex patten("^([^:]*): ?(.*)$");
-    smatch subMatch;
-    if(regex_match(line, subMatch, patten)) {  /// 将请求头的内容存储到哈希map中
-        header_[subMatch[1]] = subMatch[2];
+/// 请求头：NAME ":" OWS VALUE OWS，只记录名字和值的位置；名字必须是token，紧跟':'
+bool HttpRequest::ParseHeader_(const char* begin, const char* end) {
+    const char* colon = HttpScan::ScanToken(begin, end);
+    if(colon == end || *colon != ':' || colon == begin || headerCnt_ >= MAX_HEADERS) {
+        LOG_ERROR("Header Error");
+        return false;
     }
-    else {
-        state_ = BODY;
+    const char* value = colon + 1;
+    while(value < end && (*value == ' ' || *value == '\t')) { value++; }
+    const char* valueEnd = end;
+    while(valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) { valueEnd--; }
+
+    Header& header = headers_[headerCnt_++];
+    header.name = Span{static_cast<uint32_t>(begin - base_), static_cast<uint32_t>(colon - begin)};
+    header.value = Span{static_cast<uint32_t>(value - base_), static_cast<uint32_t>(valueEnd - value)};
+
+    if(colon - begin == 14 && strncasecmp(begin, "Content-Length", 14) == 0) {
+        size_t len = 0;
+        for(const char* p = value; p < valueEnd; p++) {
+            if(*p < '0' || *p > '9' || len > MAX_BODY_SIZE) { return false; }
+            len = len * 10 + (*p - '0');
+        }
+        if(len > MAX_BODY_SIZE) { return false; }
+        contentLen_ = len;
     }
+    return true;
 }
 
-/// 解析body
-void HttpRequest::ParseBody_(const string& line) {
-    body_ = line;
-    ParsePost_();
+std::string_view HttpRequest::GetHeader(std::string_view name) const {
+    if(!base_) { return std::string_view(); }
+    for(int i = 0; i < headerCnt_; i++) {
+        const Header& header = headers_[i];
+        if(header.name.len == name.size()
+                && strncasecmp(base_ + header.name.off, name.data(), name.size()) == 0) {
+            return View_(header.value);
+        }
+    }
+    return std::string_view();
+}
+
+/// 解析body，只记下位置
+void HttpRequest::ParseBody_(std::string_view body) {
+    body_ = Span{static_cast<uint32_t>(body.data() - base_), static_cast<uint32_t>(body.size())};
     state_ = FINISH;
-    LOG_DEBUG("Body:%s, len:%d", line.c_str(), line.size());
+    LOG_DEBUG("Body:%.*s, len:%zu", (int)body.size(), body.data(), body.size());
 }
 
 int HttpRequest::ConverHex(char ch) {
@@ -123,63 +212,48 @@ int HttpRequest::ConverHex(char ch) {
 
 /// 如果body是post请求，则解析post请求
 void HttpRequest::ParsePost_() {
-    if(method_ == "POST" && header_["Content-Type"] == "application/x-www-form-urlencoded") {
-        ParseFromUrlencoded_();
-        if(DEFAULT_HTML_TAG.count(path_)) {
-            int tag = DEFAULT_HTML_TAG.find(path_)->second;
+    std::string_view type = GetHeader("Content-Type");
+    if(method() == "POST" && type.size() >= 33
+            && strncasecmp(type.data(), "application/x-www-form-urlencoded", 33) == 0) {
+        isForm_ = true;             /// 表单推迟到GetPost时再解码
+        for(auto &item: DEFAULT_HTML_TAG) {
+            if(item.first != path()) { continue; }
+            int tag = item.second;
             LOG_DEBUG("Tag:%d", tag);
             if(tag == 0 || tag == 1) {
-                bool isLogin = (tag == 1);
-                if(UserVerify(post_["username"], post_["password"], isLogin)) {
-                    path_ = "/welcome.html";
-                } 
-                else {
-                    path_ = "/error.html";
-                }
+                verifyTag_ = tag;       /// 查数据库推迟到Verify()，解析不阻塞
             }
+            break;
         }
     }   
 }
 
-void HttpRequest::ParseFromUrlencoded_() {
-    if(body_.size() == 0) { return; }
-
-    string key, value;
-    int num = 0;
-    int n = body_.size();
-    int i = 0, j = 0;
+void HttpRequest::Verify() {
+    assert(verifyTag_ >= 0);
+    bool isLogin = (verifyTag_ == 1);
+    verifyTag_ = -1;
+    if(UserVerify(GetPost("username"), GetPost("password"), isLogin)) {
+        Rewrite_("/welcome.html");
+    } 
+    else {
+        Rewrite_("/error.html");
+    }
+}
 
-    for(; i < n; i++) {
-        char ch = body_[i];
-        switch (ch) {
-        case '=':
-            key = body_.substr(j, i - j);
-            j = i + 1;
-            break;
-        case '+':
-            body_[i] = ' ';
-            break;
-        case '%':
-            num = ConverHex(body_[i + 1]) * 16 + ConverHex(body_[i + 2]);
-            body_[i + 2] = num % 10 + '0';
-            body_[i + 1] = num / 10 + '0';
+/// '+'换成空格，%XY换成ConverHex算出的两位数字，和原来整体解码body的结果一致
+std::string HttpRequest::Decode_(std::string_view text) {
+    std::string out(text);
+    for(size_t i = 0; i < out.size(); i++) {
+        if(out[i] == '+') {
+            out[i] = ' ';
+        } else if(out[i] == '%' && i + 2 < out.size()) {
+            int num = ConverHex(out[i + 1]) * 16 + ConverHex(out[i + 2]);
+            out[i + 2] = num % 10 + '0';
+            out[i + 1] = num / 10 + '0';
             i += 2;
-            break;
-        case '&':
-            value = body_.substr(j, i - j);
-            j = i + 1;
-            post_[key] = value;
-            LOG_DEBUG("%s = %s", key.c_str(), value.c_str());
-            break;
-        default:
-            break;
         }
     }
-    assert(j <= i);
-    if(post_.count(key) == 0 && j < i) {
-        value = body_.substr(j, i - j);
-        post_[key] = value;
-    }
+    return out;
 }
 
 bool HttpRequest::UserVerify(const string &name, const string &pwd, bool isLogin) {
@@ -243,34 +317,45 @@ bool HttpRequest::UserVerify(const string &name, const string &pwd, bool isLogin
     return flag;
 }
 
-std::string HttpRequest::path() const{
-    return path_;
-}
-
-/// 返回响应path
-std::string& HttpRequest::path(){
-    return path_;
+/// 返回响应path：改写过的用改写后的
+std::string_view HttpRequest::path() const {
+    if(rewriteLen_ > 0) { return std::string_view(rewrite_, rewriteLen_); }
+    return base_ ? View_(path_) : std::string_view();
 }
-std::string HttpRequest::method() const {
-    return method_;
+std::string_view HttpRequest::method() const {
+    return base_ ? View_(method_) : std::string_view();
 }
 
-std::string HttpRequest::version() const {
-    return version_;
+std::string_view HttpRequest::version() const {
+    return base_ ? View_(version_) : std::string_view();
 }
 
-std::string HttpRequest::GetPost(const std::string& key) const {
-    assert(key != "");
-    if(post_.count(key) == 1) {
-        return post_.find(key)->second;
+/// 每次从body里找：'&'结尾的键值对后面的覆盖前面的，最后一个键值对只在前面没有同一个key时才算
+std::string HttpRequest::GetPost(std::string_view key) const {
+    assert(!key.empty());
+    if(!isForm_ || !base_) { return std::string(); }
+    std::string_view body = View_(body_);
+    std::string_view name;
+    std::string value;
+    bool found = false;
+    size_t n = body.size(), i = 0, j = 0;
+    for(; i < n; i++) {
+        char ch = body[i];
+        if(ch == '=') {
+            name = body.substr(j, i - j);
+            j = i + 1;
+        } else if(ch == '%') {
+            i += 2;                 /// %XY作为一个整体，里面的'='、'&'不算分隔符
+        } else if(ch == '&') {
+            if(Decode_(name) == key) {
+                value = Decode_(body.substr(j, i - j));
+                found = true;
+            }
+            j = i + 1;
+        }
     }
-    return "";
-}
-
-std::string HttpRequest::GetPost(const char* key) const {
-    assert(key != nullptr);
-    if(post_.count(key) == 1) {
-        return post_.find(key)->second;
+    if(!found && j < i && Decode_(name) == key) {
+        value = Decode_(body.substr(j, i - j));
     }
-    return "";
+    return value;
 }
@@ -2,29 +2,36 @@
  * @Author       : mark
  * @Date         : 2020-06-25
  * @copyleft Apache 2.0
- */ 
+ */
 #ifndef HTTP_REQUEST_H
 #define HTTP_REQUEST_H
 
 #include <unordered_map>
 #include <unordered_set>
+#include <algorithm>
 #include <string>
-#include <regex>
-#include <errno.h>     
+#include <string_view>
+#include <errno.h>
+#include <strings.h>      // strncasecmp
 #include <mysql/mysql.h>  //mysql
 
 #include "../buffer/buffer.h"
+#include "httpscan.h"
 #include "../log/log.h"
 #include "../pool/sqlconnpool.h"
 #include "../pool/sqlconnRAII.h"
 
+/// 可重入的状态机解析器：请求不完整时返回NO_REQUEST，记下已解析到的偏移，下次read()之后接着解析
+/// 请求行、请求头、path和body都只记录在readBuff_里的偏移和长度，不拷贝、不分配内存；
+/// 偏移相对请求的起始位置（buff.Peek()），Buffer扩容或搬移数据后依然有效
+/// 改写过的path（补.html、登录结果页）放在对象内的小数组里；表单在GetPost时才从body里解码
 class HttpRequest {
 public:
     enum PARSE_STATE {
         REQUEST_LINE,    ///
         HEADERS,         /// 请求头
         BODY,           /// 请求体
-        FINISH,        
+        FINISH,
     };
 
     enum HTTP_CODE {
@@ -37,43 +44,91 @@ public:
         INTERNAL_ERROR,
         CLOSED_CONNECTION,
     };
-    
+
     HttpRequest() { Init(); }
     ~HttpRequest() = default;
 
     void Init();
-    bool parse(Buffer& buff);
 
-    std::string path() const;
-    std::string& path();
-    std::string method() const;
-    std::string version() const;
-    std::string GetPost(const std::string& key) const;
-    std::string GetPost(const char* key) const;
+    /// 解析buff中的请求：NO_REQUEST 数据还不完整，GET_REQUEST 解析完一个请求，BAD_REQUEST 请求格式错误
+    HTTP_CODE parse(Buffer& buff);
+
+    /// 响应生成完以后调用，把这个请求占用的字节从buff中取走
+    void Consume(Buffer& buff);
+
+    /// 和method()一样只在Consume之前有效
+    std::string_view path() const;
+    std::string_view method() const;
+    std::string_view version() const;
+
+    /// 按名字查找请求头（不区分大小写），只在Consume之前有效
+    std::string_view GetHeader(std::string_view name) const;
+
+    /// 表单里key对应的解码后的值，没有时为空；只在Consume之前有效
+    std::string GetPost(std::string_view key) const;
 
     bool IsKeepAlive() const;
 
-    /* 
-    todo 
+    /// 登录/注册请求要查数据库，解析时只记下来，由调用者在合适的线程里调用Verify()，再生成响应
+    bool NeedsVerify() const { return verifyTag_ >= 0; }
+    /// 查数据库校验用户名密码，按结果改写path；会阻塞在MySQL上
+    void Verify();
+
+    /*
+    todo
     void HttpConn::ParseFormData() {}
     void HttpConn::ParseJson() {}
     */
 
 private:
-    bool ParseRequestLine_(const std::string& line);
-    void ParseHeader_(const std::string& line);
-    void ParseBody_(const std::string& line);
+    /// 相对请求起始位置的一段字节
+    struct Span {
+        uint32_t off;
+        uint32_t len;
+    };
+
+    struct Header {
+        Span name;
+        Span value;
+    };
+
+    static const int MAX_HEADERS = 32;
+    static const size_t MAX_REWRITE = 32;            /// 改写后path的最大长度
+    static const size_t MAX_HEAD_SIZE = 64 * 1024;   /// 请求行 + 请求头的最大长度
+    static const size_t MAX_BODY_SIZE = 1024 * 1024;
+
+    std::string_view View_(Span span) const {
+        return std::string_view(base_ + span.off, span.len);
+    }
+
+    bool ParseRequestLine_(const char* begin, const char* end);
+    bool ParseHeader_(const char* begin, const char* end);
+    void ParseBody_(std::string_view body);
+    HTTP_CODE Finish_();
 
     void ParsePath_();
     void ParsePost_();
-    void ParseFromUrlencoded_();
+    void Rewrite_(std::string_view path, std::string_view suffix = std::string_view());
+    static std::string Decode_(std::string_view text);
 
     static bool UserVerify(const std::string& name, const std::string& pwd, bool isLogin);
 
     PARSE_STATE state_;
-    std::string method_, path_, version_, body_;
-    std::unordered_map<std::string, std::string> header_;
-    std::unordered_map<std::string, std::string> post_;
+    const char* base_;          /// 本次parse时请求的起始地址
+    size_t parsed_;             /// 已经解析完的完整行的结束偏移
+    size_t scanned_;            /// 已经确认没有CRLF的位置，下次从这里继续找
+    size_t contentLen_;
+
+    Span method_, uri_, version_;
+    Header headers_[MAX_HEADERS];
+    int headerCnt_;
+
+    bool isKeepAlive_;
+    int verifyTag_;             /// 待校验的DEFAULT_HTML_TAG（0 注册，1 登录），-1表示不需要
+    Span path_, body_;          /// uri里'?'之前的部分；body
+    bool isForm_;               /// body是application/x-www-form-urlencoded
+    char rewrite_[MAX_REWRITE];
+    size_t rewriteLen_;         /// 改写后path的长度，0表示没有改写，path就是path_
 
     static const std::unordered_set<std::string> DEFAULT_HTML;
     static const std::unordered_map<std::string, int> DEFAULT_HTML_TAG;
@@ -31,6 +31,9 @@ const unordered_map<string, string> HttpResponse::SUFFIX_TYPE = {
 
 const unordered_map<int, string> HttpResponse::CODE_STATUS = {
     { 200, "OK" },
+    { 206, "Partial Content" },
+    { 304, "Not Modified" },
+    { 416, "Range Not Satisfiable" },
     { 400, "Bad Request" },
     { 403, "Forbidden" },
     { 404, "Not Found" },
@@ -42,12 +45,30 @@ const unordered_map<int, string> HttpResponse::CODE_PATH = {
     { 404, "/404.html" },
 };
 
+/// 值得压缩的文本类型
+const unordered_set<string> HttpResponse::COMPRESSIBLE_SUFFIX = {
+    ".html", ".xml", ".xhtml", ".txt", ".rtf", ".css", ".js", ".json", ".svg", ".ttf", ".otf", ".eot",
+};
+
+/// 必须定义在CODE_STATUS后面，按定义顺序初始化
+const unordered_map<int, string> HttpResponse::ERROR_BODY = [] {
+    unordered_map<int, string> bodies;
+    for(auto& status: CODE_STATUS) { bodies[status.first] = MakeErrorBody_(status.first, "File NotFound!"); }
+    return bodies;
+}();
+
+thread_local unordered_map<string, HttpResponse::HeaderSlots> HttpResponse::headerCache_;
+size_t HttpResponse::smallFileBytes = 8 << 10;
+
 HttpResponse::HttpResponse() {
     code_ = -1;
     path_ = srcDir_ = "";
     isKeepAlive_ = false;
-    mmFile_ = nullptr; 
-    mmFileStat_ = { 0 };
+    acceptEncoding_ = 0;
+    encoding_ = FileCache::ENCODING_IDENTITY;
+    compressible_ = false;
+    isHead_ = false;
+    st_ = { 0 };
 };
 
 HttpResponse::~HttpResponse() {
@@ -55,47 +76,334 @@ HttpResponse::~HttpResponse() {
 }
 
 /// 响应数据头初始化
-void HttpResponse::Init(const string& srcDir, string& path, bool isKeepAlive, int code){
+void HttpResponse::Init(const string& srcDir, string_view path, bool isKeepAlive, int code, int acceptEncoding){
     assert(srcDir != "");
-    if(mmFile_) { UnmapFile(); }
+    UnmapFile();
     code_ = code;
+    acceptEncoding_ = acceptEncoding;
+    encoding_ = FileCache::ENCODING_IDENTITY;
+    compressible_ = false;
     isKeepAlive_ = isKeepAlive;  /// 如果是http1.1请求，则视为长连接
-    path_ = path;
+    path_.assign(path.data(), path.size());
     srcDir_ = srcDir;
-    mmFile_ = nullptr; 
-    mmFileStat_ = { 0 };
+    isHead_ = false;
+    ifNoneMatch_ = ifModifiedSince_ = string_view();
+    st_ = { 0 };
+    range_ = ifRange_ = string_view();
+    ranges_.clear();
+    partHeads_.clear();
+}
+
+void HttpResponse::Trim() {
+    UnmapFile();
+    string().swap(path_);
+    string().swap(srcDir_);
+    string().swap(boundary_);
+    std::vector<std::pair<size_t, size_t>>().swap(ranges_);
+    std::vector<string>().swap(partHeads_);
+}
+
+void HttpResponse::SetConditional(bool isHead, string_view ifNoneMatch, string_view ifModifiedSince) {
+    isHead_ = isHead;
+    ifNoneMatch_ = ifNoneMatch;
+    ifModifiedSince_ = ifModifiedSince;
+}
+
+void HttpResponse::SetRange(string_view range, string_view ifRange) {
+    range_ = range;
+    ifRange_ = ifRange;
 }
 
 void HttpResponse::MakeResponse(Buffer& buff) {
-    /* 判断请求的资源文件 */
-    if(stat((srcDir_ + path_).data(), &mmFileStat_) < 0 || S_ISDIR(mmFileStat_.st_mode)) {
+    /* 判断请求的资源文件，stat结果和映射都来自文件缓存；HEAD和条件请求先只要stat结果 */
+    bool conditional = !ifNoneMatch_.empty() || !ifModifiedSince_.empty();
+    if(code_ == 400) {
+        /// 解析失败的请求路径不可信，直接发400页面
+    }
+    else if(!(file_ = FileCache::Instance()->Get(srcDir_ + path_, !isHead_ && !conditional))) {
         code_ = 404;
     }
-    else if(!(mmFileStat_.st_mode & S_IROTH)) {
+    else if(!(file_->st.st_mode & S_IROTH)) {
         code_ = 403;
     }
     else if(code_ == -1) { 
         code_ = 200; 
     }
+    bool ranged = !range_.empty() && !isHead_;
+    if(code_ == 200) {
+        st_ = file_->st;
+        /// 范围请求只针对原文件，但被忽略时发的整个文件和普通请求共用响应头槽位，Vary要一致
+        SelectEncoding_(!ranged);
+        if(NotModified_()) {
+            code_ = 304;
+        }
+        else if(!isHead_ && encoding_ == FileCache::ENCODING_IDENTITY) {
+            file_ = FileCache::Instance()->Get(srcDir_ + path_);   /// 要发送内容了，取映射
+            if(!file_) { code_ = 404; }
+            else if(ranged && IfRangeMatch_()) { ParseRange_(); }
+        }
+    }
     ErrorHtml_();
+    CachedHeader* slot = HeaderSlot_();
+    if(slot && AddCachedHeader_(buff, *slot)) { return; }
+    size_t begin = buff.ReadableBytes();
+    size_t len = code_ == 304 ? 0 : FileLen();     /// 200和错误页的body长度，校验槽位和拼整块用
     AddStateLine_(buff);
     AddHeader_(buff);
     AddContent_(buff);
+    if(slot) { SaveHeader_(buff, begin, len, slot); }
+}
+
+/// 200、304和错误页可以缓存；除了304都要文件内容可用，否则AddContent_会改发ErrorContent
+HttpResponse::CachedHeader* HttpResponse::HeaderSlot_() {
+    int kind;
+    if(code_ == 200) { kind = 0; }
+    else if(code_ == 304) { kind = 1; }
+    else if(CODE_PATH.count(code_) == 1) { kind = 2; }
+    else { return nullptr; }
+    if(kind != 1 && (!file_ || (!isHead_ && file_->st.st_size > 0 && !file_->data && file_->fd < 0))) {
+        return nullptr;
+    }
+    if(headerCache_.size() >= MAX_HEADER_PATHS && headerCache_.count(path_) == 0) { headerCache_.clear(); }
+    return &headerCache_[path_][(kind * 3 + encoding_) * 2 + isKeepAlive_];
+}
+
+bool HttpResponse::AddCachedHeader_(Buffer& buff, CachedHeader& slot) {
+    if(slot.head.empty() || slot.ino != st_.st_ino || slot.size != st_.st_size
+            || slot.mtime.tv_sec != st_.st_mtim.tv_sec || slot.mtime.tv_nsec != st_.st_mtim.tv_nsec
+            || (code_ != 304 && slot.len != FileLen())) {
+        return false;
+    }
+    const char* date = Date_();
+    if(slot.whole && !isHead_) {
+        /// 整块响应不可变，还在发送的连接持有旧的那块；秒数变了换一块新的
+        if(memcmp(slot.whole->data + slot.dateOff, date, strlen(date)) != 0) {
+            shared_ptr<MappedFile> whole = make_shared<MappedFile>();
+            whole->memory = slot.whole->memory;
+            whole->data = whole->memory.data();
+            whole->st = slot.whole->st;
+            memcpy(whole->data + slot.dateOff, date, strlen(date));
+            slot.whole = whole;
+        }
+        file_ = slot.whole;
+        ranges_.assign(1, make_pair<size_t, size_t>(0, file_->st.st_size));
+        return true;
+    }
+    buff.Append(slot.head);
+    memcpy(buff.BeginWrite() - slot.head.size() + slot.dateOff, date, strlen(date));
+    /* 和AddContent_的结尾一样处理文件 */
+    if(code_ == 304 || isHead_) { file_.reset(); }
+    else { ranges_.assign(1, make_pair<size_t, size_t>(0, file_->st.st_size)); }
+    return true;
+}
+
+/// 把刚生成的响应头存进槽位，Date的值下次命中时覆盖；小文件的GET再把头和内容拼成一块
+void HttpResponse::SaveHeader_(const Buffer& buff, size_t begin, size_t len, CachedHeader* slot) {
+    slot->head.assign(buff.Peek() + begin, buff.ReadableBytes() - begin);
+    slot->whole.reset();
+    string::size_type pos = slot->head.find("\r\nDate: ");
+    if(pos == string::npos) {
+        slot->head.clear();
+        return;
+    }
+    slot->dateOff = pos + 8;
+    slot->ino = st_.st_ino;
+    slot->size = st_.st_size;
+    slot->mtime = st_.st_mtim;
+    slot->len = len;
+    if(code_ != 304 && !isHead_ && file_ && file_->data && len > 0 && len <= smallFileBytes) {
+        shared_ptr<MappedFile> whole = make_shared<MappedFile>();
+        whole->memory.reserve(slot->head.size() + len);
+        whole->memory.assign(slot->head.begin(), slot->head.end());
+        whole->memory.insert(whole->memory.end(), file_->data, file_->data + len);
+        whole->data = whole->memory.data();
+        whole->st = file_->st;
+        whole->st.st_size = whole->memory.size();
+        slot->whole = whole;
+    }
 }
 
 char* HttpResponse::File() {
-    return mmFile_;
+    return file_ ? file_->data : nullptr;
 }
 
 size_t HttpResponse::FileLen() const {
-    return mmFileStat_.st_size;
+    return file_ ? file_->st.st_size : 0;
 }
 
 void HttpResponse::ErrorHtml_() {
     if(CODE_PATH.count(code_) == 1) {
         path_ = CODE_PATH.find(code_)->second;
-        stat((srcDir_ + path_).data(), &mmFileStat_);
+        file_ = FileCache::Instance()->Get(srcDir_ + path_, !isHead_);
+        if(file_) { st_ = file_->st; }      /// 错误页的版本，校验缓存的响应头用
+    }
+}
+
+/// ETag由inode、大小、修改时间生成，压缩版本加上编码后缀，不同表示的ETag不同
+string HttpResponse::ETag_() const {
+    static const char* const SUFFIX[] = { "", "-gzip", "-br" };
+    char etag[96];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx.%lx%s\"", static_cast<unsigned long>(st_.st_ino),
+             static_cast<unsigned long>(st_.st_size), static_cast<unsigned long>(st_.st_mtim.tv_sec),
+             static_cast<unsigned long>(st_.st_mtim.tv_nsec), SUFFIX[encoding_]);
+    return etag;
+}
+
+string HttpResponse::HttpDate_(time_t t) {
+    struct tm tm;
+    char date[64];
+    gmtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return date;
+}
+
+/// 每个线程缓存格式化好的当前时间，秒数变了才重新格式化；长度固定29字节，可以原地覆盖
+const char* HttpResponse::Date_() {
+    thread_local time_t last = 0;
+    thread_local char date[32];
+    time_t now = time(nullptr);
+    if(now != last) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        last = now;
+    }
+    return date;
+}
+
+/// If-None-Match优先（弱比较）；没有If-None-Match时才看If-Modified-Since
+bool HttpResponse::NotModified_() const {
+    if(!ifNoneMatch_.empty()) {
+        string etag = ETag_();
+        string_view list = ifNoneMatch_;
+        while(!list.empty()) {
+            string_view item = list.substr(0, list.find(','));
+            list.remove_prefix(min(list.size(), item.size() + 1));
+            while(!item.empty() && (item.front() == ' ' || item.front() == '\t')) { item.remove_prefix(1); }
+            while(!item.empty() && (item.back() == ' ' || item.back() == '\t')) { item.remove_suffix(1); }
+            if(item.substr(0, 2) == "W/") { item.remove_prefix(2); }
+            if(item == "*" || item == etag) { return true; }
+        }
+        return false;
+    }
+    if(!ifModifiedSince_.empty()) {
+        struct tm tm = { 0 };
+        string since(ifModifiedSince_);
+        const char* end = strptime(since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return end && *end == '\0' && st_.st_mtime <= timegm(&tm);
     }
+    return false;
+}
+
+/// If-Range：ETag必须强匹配，日期必须和Last-Modified完全相同，否则忽略Range发送整个文件
+bool HttpResponse::IfRangeMatch_() const {
+    if(ifRange_.empty()) { return true; }
+    if(ifRange_.front() == '"') { return ifRange_ == ETag_(); }
+    if(ifRange_.substr(0, 2) == "W/") { return false; }
+    return ifRange_ == HttpDate_(st_.st_mtime);
+}
+
+/// Range: bytes=first-last, first-, -suffix；格式不对或范围太多时忽略，全都超出文件大小时416
+void HttpResponse::ParseRange_() {
+    const size_t size = file_->st.st_size;
+    string_view spec = range_;
+    if(spec.substr(0, 6) != "bytes=") { return; }
+    spec.remove_prefix(6);
+    vector<pair<size_t, size_t>> ranges;
+    size_t count = 0;
+    while(!spec.empty()) {
+        string_view item = spec.substr(0, spec.find(','));
+        spec.remove_prefix(min(spec.size(), item.size() + 1));
+        while(!item.empty() && (item.front() == ' ' || item.front() == '\t')) { item.remove_prefix(1); }
+        while(!item.empty() && (item.back() == ' ' || item.back() == '\t')) { item.remove_suffix(1); }
+        if(item.empty()) { continue; }
+        if(++count > MAX_RANGES) { return; }
+        string_view::size_type dash = item.find('-');
+        if(dash == string_view::npos) { return; }
+        string_view first = item.substr(0, dash), last = item.substr(dash + 1);
+        if((first.empty() && last.empty()) || item.find_first_not_of("0123456789-") != string_view::npos
+                || last.find('-') != string_view::npos || first.size() > 18 || last.size() > 18) {
+            return;
+        }
+        size_t begin, end;      /// [begin, end]
+        if(first.empty()) {     /// 最后suffix个字节
+            size_t suffix = stoull(string(last));
+            if(suffix == 0 || size == 0) { continue; }
+            begin = suffix >= size ? 0 : size - suffix;
+            end = size - 1;
+        } else {
+            begin = stoull(string(first));
+            end = last.empty() ? SIZE_MAX : stoull(string(last));
+            if(end < begin) { return; }
+            if(begin >= size) { continue; }
+            if(end >= size) { end = size - 1; }
+        }
+        ranges.emplace_back(begin, end - begin + 1);
+    }
+    if(count == 0) { return; }
+    if(ranges.empty()) {
+        code_ = 416;
+        return;
+    }
+    code_ = 206;
+    ranges_.swap(ranges);
+    if(ranges_.size() > 1) {
+        /// rand()不是线程安全的，工作线程各用一个随机数引擎，第一次用时播种
+        thread_local std::mt19937_64 engine(std::random_device{}());
+        char boundary[48];
+        snprintf(boundary, sizeof(boundary), "webserver-%lx-%llx", static_cast<unsigned long>(st_.st_mtime),
+                 static_cast<unsigned long long>(engine()));
+        boundary_ = boundary;
+        for(auto& range: ranges_) {
+            partHeads_.push_back("\r\n--" + boundary_ + "\r\nContent-Type: " + GetFileType_()
+                + "\r\nContent-Range: bytes " + to_string(range.first) + "-" + to_string(range.first + range.second - 1)
+                + "/" + to_string(size) + "\r\n\r\n");
+        }
+        partHeads_.push_back("\r\n--" + boundary_ + "--\r\n");
+    }
+}
+
+void HttpResponse::AddPartBoundary(Buffer& buff, size_t i) const {
+    if(i + 1 < partHeads_.size()) { buff.Append(partHeads_[i + 1]); }
+}
+
+/// 文本类型优先发br，其次gzip；压缩版本还没准备好时先发原文件
+void HttpResponse::SelectEncoding_(bool negotiate) {
+    string::size_type idx = path_.find_last_of('.');
+    compressible_ = idx != string::npos && COMPRESSIBLE_SUFFIX.count(path_.substr(idx)) == 1;
+    if(!negotiate || !compressible_ || !acceptEncoding_) { return; }
+    const FileCache::Encoding preferred[] = { FileCache::ENCODING_BR, FileCache::ENCODING_GZIP };
+    for(FileCache::Encoding encoding: preferred) {
+        if(!(acceptEncoding_ & (1 << encoding))) { continue; }
+        FilePtr encoded = FileCache::Instance()->GetEncoded(srcDir_ + path_, file_, encoding, compressible_);
+        if(encoded) {
+            file_ = encoded;
+            encoding_ = encoding;
+            return;
+        }
+    }
+}
+
+int HttpResponse::ParseAcceptEncoding(string_view header) {
+    int encodings = 0;
+    while(!header.empty()) {
+        string_view item = header.substr(0, header.find(','));
+        header.remove_prefix(min(header.size(), item.size() + 1));
+        string_view name = item.substr(0, item.find(';'));
+        while(!name.empty() && (name.front() == ' ' || name.front() == '\t')) { name.remove_prefix(1); }
+        while(!name.empty() && (name.back() == ' ' || name.back() == '\t')) { name.remove_suffix(1); }
+        /// ;q=0 / q=0.0 / q=0.000 表示不接受
+        string_view::size_type q = item.find("q=", item.find(';'));
+        if(q != string_view::npos) {
+            string_view value = item.substr(q + 2);
+            value = value.substr(0, value.find_first_of(" \t;"));
+            if(!value.empty() && value.find_first_not_of("0.") == string_view::npos) { continue; }
+        }
+        if(name.size() == 4 && strncasecmp(name.data(), "gzip", 4) == 0) { encodings |= 1 << FileCache::ENCODING_GZIP; }
+        else if(name.size() == 2 && strncasecmp(name.data(), "br", 2) == 0) { encodings |= 1 << FileCache::ENCODING_BR; }
+        else if(name == "*") { encodings |= (1 << FileCache::ENCODING_GZIP) | (1 << FileCache::ENCODING_BR); }
+    }
+    return encodings;
 }
 
 void HttpResponse::AddStateLine_(Buffer& buff) {
@@ -111,41 +419,73 @@ void HttpResponse::AddStateLine_(Buffer& buff) {
 }
 
 void HttpResponse::AddHeader_(Buffer& buff) {
-    buff.Append("Connection: ");
+    buff.Append("Date: ");
+    buff.Append(Date_(), strlen(Date_()));
+    buff.Append("\r\nConnection: ");
     if(isKeepAlive_) {
         buff.Append("keep-alive\r\n");
         buff.Append("keep-alive: max=6, timeout=120\r\n");
     } else{
         buff.Append("close\r\n");
     }
-    buff.Append("Content-type: " + GetFileType_() + "\r\n");
+    if(code_ == 206 && ranges_.size() > 1) {
+        buff.Append("Content-type: multipart/byteranges; boundary=" + boundary_ + "\r\n");
+    } else {
+        buff.Append("Content-type: " + GetFileType_() + "\r\n");
+    }
+    if(code_ == 200 || code_ == 206) { buff.Append("Accept-Ranges: bytes\r\n"); }
+    if(encoding_ == FileCache::ENCODING_GZIP) { buff.Append("Content-Encoding: gzip\r\n"); }
+    else if(encoding_ == FileCache::ENCODING_BR) { buff.Append("Content-Encoding: br\r\n"); }
+    if(compressible_) { buff.Append("Vary: Accept-Encoding\r\n"); }
+    if(code_ == 200 || code_ == 206 || code_ == 304) {
+        buff.Append("ETag: " + ETag_() + "\r\n");
+        buff.Append("Last-Modified: " + HttpDate_(st_.st_mtime) + "\r\n");
+    }
 }
 
-void HttpResponse::AddContent_(Buffer& buff) {
-    int srcFd = open((srcDir_ + path_).data(), O_RDONLY);
-    if(srcFd < 0) { 
-        ErrorContent(buff, "File NotFound!");
-        return; 
+/// 304没有body；HEAD和GET的响应头一样，只是不带body，也不需要映射文件
+void HttpResponse::AddContent_(Buffer &buff) {
+    if(code_ == 304) {
+        file_.reset();
+        buff.Append("\r\n");
+        return;
     }
-
-    /* 将文件映射到内存提高文件的访问速度 
-        MAP_PRIVATE 建立一个写入时拷贝的私有映射*/
-    LOG_DEBUG("file path %s", (srcDir_ + path_).data());
-    int* mmRet = (int*)mmap(0, mmFileStat_.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
-    if(*mmRet == -1) {
+    if(code_ == 416) {
+        file_.reset();
+        buff.Append("Content-Range: bytes */" + to_string(st_.st_size) + "\r\nContent-length: 0\r\n\r\n");
+        return;
+    }
+    if(code_ == 206) {
+        if(ranges_.size() == 1) {
+            buff.Append("Content-Range: bytes " + to_string(ranges_[0].first) + "-"
+                + to_string(ranges_[0].first + ranges_[0].second - 1) + "/" + to_string(st_.st_size) + "\r\n");
+            buff.Append("Content-length: " + to_string(ranges_[0].second) + "\r\n\r\n");
+            return;
+        }
+        size_t len = 0;
+        for(auto& range: ranges_) { len += range.second; }
+        for(auto& head: partHeads_) { len += head.size(); }
+        buff.Append("Content-length: " + to_string(len) + "\r\n\r\n");
+        buff.Append(partHeads_[0]);
+        return;
+    }
+    if(!file_ || (!isHead_ && file_->st.st_size > 0 && !file_->data && file_->fd < 0)) {
+        file_.reset();
         ErrorContent(buff, "File NotFound!");
         return; 
     }
-    mmFile_ = (char*)mmRet;
-    close(srcFd);
-    buff.Append("Content-length: " + to_string(mmFileStat_.st_size) + "\r\n\r\n");
+    LOG_DEBUG("file path %s", (srcDir_ + path_).data());
+    buff.Append("Content-length: " + to_string(file_->st.st_size) + "\r\n\r\n");
+    if(isHead_) { file_.reset(); }
+    else { ranges_.assign(1, make_pair<size_t, size_t>(0, file_->st.st_size)); }
 }
 
 void HttpResponse::UnmapFile() {
-    if(mmFile_) {
-        munmap(mmFile_, mmFileStat_.st_size);
-        mmFile_ = nullptr;
-    }
+    file_.reset();
+}
+
+FilePtr HttpResponse::DetachFile() {
+    return std::move(file_);
 }
 
 string HttpResponse::GetFileType_() {
@@ -161,21 +501,30 @@ string HttpResponse::GetFileType_() {
     return "text/plain";
 }
 
-void HttpResponse::ErrorContent(Buffer& buff, string message) 
-{
+string HttpResponse::MakeErrorBody_(int code, const string& message) {
     string body;
     string status;
     body += "<html><title>Error</title>";
     body += "<body bgcolor=\"ffffff\">";
-    if(CODE_STATUS.count(code_) == 1) {
-        status = CODE_STATUS.find(code_)->second;
+    if(CODE_STATUS.count(code) == 1) {
+        status = CODE_STATUS.find(code)->second;
     } else {
         status = "Bad Request";
     }
-    body += to_string(code_) + " : " + status  + "\n";
+    body += to_string(code) + " : " + status  + "\n";
     body += "<p>" + message + "</p>";
     body += "<hr><em>TinyWebServer</em></body></html>";
+    return body;
+}
 
-    buff.Append("Content-length: " + to_string(body.size()) + "\r\n\r\n");
-    buff.Append(body);
+/// 错误页文件不存在时的body，默认消息直接用启动时生成好的
+void HttpResponse::ErrorContent(Buffer& buff, string message) 
+{
+    auto found = ERROR_BODY.find(code_);
+    string custom;
+    const string* body = &custom;
+    if(found != ERROR_BODY.end() && message == "File NotFound!") { body = &found->second; }
+    else { custom = MakeErrorBody_(code_, message); }
+    buff.Append("Content-length: " + to_string(body->size()) + "\r\n\r\n");
+    if(!isHead_) { buff.Append(*body); }
 }
@@ -7,47 +7,129 @@
 #define HTTP_RESPONSE_H
 
 #include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <vector>
+#include <string_view>
+#include <random>
+#include <strings.h>     // strncasecmp
 #include <fcntl.h>       // open
 #include <unistd.h>      // close
 #include <sys/stat.h>    // stat
 #include <sys/mman.h>    // mmap, munmap
+#include <time.h>        // gmtime_r, strptime, timegm
 
 #include "../buffer/buffer.h"
 #include "../log/log.h"
+#include "filecache.h"
 
 class HttpResponse {
 public:
     HttpResponse();
     ~HttpResponse();
 
-    void Init(const std::string& srcDir, std::string& path, bool isKeepAlive = false, int code = -1);
+    /// acceptEncoding 客户端接受的内容编码，ParseAcceptEncoding的结果
+    void Init(const std::string& srcDir, std::string_view path, bool isKeepAlive = false, int code = -1,
+              int acceptEncoding = 0);
+    /// HEAD请求和条件请求的请求头，Init之后、MakeResponse之前调用；字符串指向读缓冲区，只在MakeResponse期间使用
+    void SetConditional(bool isHead, std::string_view ifNoneMatch, std::string_view ifModifiedSince);
+    /// GET请求的Range、If-Range请求头，同样只在MakeResponse期间使用
+    void SetRange(std::string_view range, std::string_view ifRange);
     void MakeResponse(Buffer& buff);
     void UnmapFile();
+    /// 连接空闲时调用，释放上一个响应留下的字符串和数组占的堆内存
+    void Trim();
+    /// 把映射区的引用交给调用者，本对象不再持有
+    FilePtr DetachFile();
     char* File();
     size_t FileLen() const;
-    void ErrorContent(Buffer& buff, std::string message);
+    void ErrorContent(Buffer& buff, std::string message = "File NotFound!");
     int Code() const { return code_; }
 
+    /// body由几段文件内容组成：普通响应和单个范围是1段，多个范围时每个范围一段
+    size_t Parts() const { return ranges_.size(); }
+    /// 第i段在文件里的偏移和长度
+    std::pair<size_t, size_t> Part(size_t i) const { return ranges_[i]; }
+    /// 追加第i段文件内容后面的文本：multipart的下一个分段头或结束分隔符
+    void AddPartBoundary(Buffer& buff, size_t i) const;
+
+    /// 不超过这个大小的文件，响应头和内容缓存成一块连续内存，0表示不缓存
+    static size_t smallFileBytes;
+
+    /// 解析Accept-Encoding请求头，返回 1 << FileCache::ENCODING_xxx 的位集合，q=0的编码不算
+    static int ParseAcceptEncoding(std::string_view header);
+
 private:
     void AddStateLine_(Buffer &buff);
     void AddHeader_(Buffer &buff);
     void AddContent_(Buffer &buff);
 
     void ErrorHtml_();
+    /// negotiate为false时只判断是否可压缩（决定Vary），仍然发原文件
+    void SelectEncoding_(bool negotiate);
+    bool NotModified_() const;
+    bool IfRangeMatch_() const;
+    void ParseRange_();
+    std::string ETag_() const;
+    static std::string HttpDate_(time_t t);
     std::string GetFileType_();
 
+    /// 200、304和错误页的响应头只取决于文件版本、编码和是否长连接，整块缓存起来，命中时一次拷贝再填上Date
+    static const char* Date_();
+
     int code_;
     bool isKeepAlive_;
 
     std::string path_;
     std::string srcDir_;
     
-    char* mmFile_; 
-    struct stat mmFileStat_;
+    FilePtr file_;      /// 文件缓存里共享的映射区
+    int acceptEncoding_;
+    FileCache::Encoding encoding_;  /// 实际发送的内容编码
+    bool compressible_;             /// 文本类型，响应要带Vary: Accept-Encoding
+
+    bool isHead_;
+    std::string_view ifNoneMatch_;
+    std::string_view ifModifiedSince_;
+    struct stat st_;                /// 请求的原文件的stat结果，用来生成ETag和Last-Modified
+
+    std::string_view range_;
+    std::string_view ifRange_;
+    std::vector<std::pair<size_t, size_t>> ranges_;    /// 要发送的文件片段(偏移, 长度)
+    std::vector<std::string> partHeads_;                /// multipart每个分段前面的文本，最后一项是结束分隔符
+    std::string boundary_;
+
+    /// 一个请求最多接受的范围数，超过时忽略Range，发送整个文件
+    static const size_t MAX_RANGES = 16;
+
+    /// 缓存的一份响应头，文件版本（原文件的inode、大小、修改时间）和发送的长度都对得上才能用
+    struct CachedHeader {
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        size_t len;
+        size_t dateOff;             /// Date值在head里的偏移
+        std::string head;           /// 为空表示没有缓存
+        FilePtr whole;              /// 小文件GET的完整响应（头+body），一次send发完；Date过期时重新生成
+    };
+    /// 每个路径的槽位：(200, 304, 错误页) x 编码 x 是否长连接
+    typedef std::array<CachedHeader, 3 * 3 * 2> HeaderSlots;
+    /// 当前响应对应的槽位，不能缓存时返回nullptr
+    CachedHeader* HeaderSlot_();
+    bool AddCachedHeader_(Buffer& buff, CachedHeader& slot);
+    void SaveHeader_(const Buffer& buff, size_t begin, size_t len, CachedHeader* slot);
+
+    /// 每个工作线程一份，不用加锁；路径数超过上限时整个清空
+    static thread_local std::unordered_map<std::string, HeaderSlots> headerCache_;
+    static const size_t MAX_HEADER_PATHS = 1024;
 
     static const std::unordered_map<std::string, std::string> SUFFIX_TYPE;
     static const std::unordered_map<int, std::string> CODE_STATUS;
     static const std::unordered_map<int, std::string> CODE_PATH;
+    static const std::unordered_set<std::string> COMPRESSIBLE_SUFFIX;
+    /// 默认消息的错误页body，启动时按CODE_STATUS生成好
+    static const std::unordered_map<int, std::string> ERROR_BODY;
+    static std::string MakeErrorBody_(int code, const std::string& message);
 };
 
 
@@ -0,0 +1,49 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-26
+ * @copyleft Apache 2.0
+ */
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+
+/// 请求解析用的字节扫描：找行尾的CRLF、校验token（方法名、请求头名）并找到它后面的分隔符
+/// 找CRLF用memchr找'\r'（glibc已经按CPU用SIMD实现）；校验token有AVX2一次处理32字节，有SSE4.2一次处理16字节，
+/// 否则逐字节查表，启动时按CPU支持的指令集选择一次
+class HttpScan {
+public:
+    enum Level {
+        SCALAR = 0,
+        SSE42,
+        AVX2,
+    };
+
+    /// 找到[begin, end)中第一个"\r\n"，返回'\r'的位置，没有返回nullptr
+    static const char* FindCRLF(const char* begin, const char* end);
+
+    /// 返回[begin, end)中第一个不是token字符（RFC 7230 tchar）的位置，全是token返回end
+    /// 方法名后面必须是' '，请求头名后面必须是':'，一次扫描同时完成校验和找分隔符
+    static const char* ScanToken(const char* begin, const char* end) {
+        return scanToken_(begin, end);
+    }
+
+    /// 当前CPU支持的最高级别
+    static Level Supported();
+
+    /// 当前使用的级别
+    static Level Current() { return level_; }
+
+    /// 切换实现（测试和基准用），超过CPU支持的级别时降到Supported()
+    static Level SetLevel(Level level);
+
+private:
+    typedef const char* (*ScanFunc)(const char* begin, const char* end);
+
+    static Level Init_();
+
+    static ScanFunc scanToken_;
+    static Level level_;
+};
+
+#endif //HTTP_SCAN_H
@@ -127,6 +127,7 @@ void Log::write(int level, const char *format, ...) {
     {
         unique_lock<mutex> locker(mtx_);
         lineCount_++;
+        buff_.EnsureWriteable(128);
         int n = snprintf(buff_.BeginWrite(), 128, "%d-%02d-%02d %02d:%02d:%02d.%06ld ",
                     t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
                     t.tm_hour, t.tm_min, t.tm_sec, now.tv_usec);
@@ -137,6 +138,13 @@ void Log::write(int level, const char *format, ...) {
         va_start(vaList, format);
         int m = vsnprintf(buff_.BeginWrite(), buff_.WritableBytes(), format, vaList);
         va_end(vaList);
+        if(m >= static_cast<int>(buff_.WritableBytes())) {
+            /// 尾块放不下，接一个够大的块重新格式化
+            buff_.EnsureWriteable(m + 1);
+            va_start(vaList, format);
+            m = vsnprintf(buff_.BeginWrite(), buff_.WritableBytes(), format, vaList);
+            va_end(vaList);
+        }
 
         buff_.HasWritten(m);
         buff_.Append("\n\0", 2);
@@ -5,11 +5,36 @@ int main() {
     /* 守护进程 后台运行 */
     //daemon(1, 0); 
 
+    /// 扩展配置，ServerConfig的默认值是原来的工作方式，这里开启分线程池、弹性扩容和任务截止时间
+    ServerConfig config;
+    config.subReactorNum = 0;              /* 子Reactor数量，0为单epoll + 线程池模式 */
+    config.reusePort = false;              /* SO_REUSEPORT，每个子Reactor独立监听、accept */
+    config.listenBacklog = 1024;           /* listen队列长度 */
+    config.useIoUring = false;             /* io_uring后端 */
+    config.fileCacheBytes = 64 << 20;      /* 静态文件映射缓存上限 */
+    config.fileCacheCheckMS = 1000;        /* 缓存文件重新校验间隔 */
+    config.sendfileThreshold = 0;          /* sendfile阈值，0为自动 */
+    config.useSendfile = true;             /* 大文件sendfile发送，否则分窗口mmap */
+    config.smallFileBytes = 8 << 10;       /* 小文件整块缓存响应的上限 */
+    config.diskThreadNum = 2;              /* 磁盘IO线程数，0为不做页缓存检查 */
+    config.dbThreadNum = 2;                /* 数据库线程数，0为在工作线程里查 */
+    config.bulkThreadNum = 2;              /* 大传输线程数，0为在工作线程里写 */
+    config.bulkBytes = 1 << 20;            /* 剩余待发送多少字节算大传输 */
+    config.workerAffinity = false;         /* 同一连接固定由同一个工作线程处理 */
+    config.pinWorkers = false;             /* 工作线程绑定CPU */
+    config.maxThreadNum = 16;              /* 工作线程弹性扩容的上限 */
+    config.maxDbThreadNum = 8;             /* 数据库线程弹性扩容的上限 */
+    config.poolTargetWaitMS = 5;           /* 任务等待超过多少毫秒加线程 */
+    config.poolIdleMS = 30000;             /* 临时线程空闲多少毫秒退出 */
+    config.taskDeadlineMS = 3000;          /* 读/数据库任务排队的截止时间，0为不过期 */
+    config.poolStatsMS = 10000;            /* 线程池统计输出间隔，0为不输出 */
+
     /// 超时时间60s，60s如果客户端没有任何请求，服务端主动断开  1s = 1000ms
     WebServer server(
         1316, 3, 60000, false,             /* 端口 ET模式 timeoutMs 优雅退出  */
         3306, "root", "123456", "webserver", /* Mysql配置 */
-        12, 6, true, 1, 1024);             /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        12, 6, true, 1, 1024,              /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        config);
     server.Start();
 } 
   
@@ -0,0 +1,173 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-15
+ * @copyleft Apache 2.0
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <assert.h>
+
+/// 线程池的任务：只能移动的void()可调用对象
+/// 不超过INLINE_SIZE字节、移动不抛异常的可调用对象直接放在对象内部，构造、移动、执行都不分配内存，
+/// 连接事件的任务（this + fd + generation）属于这种；更大的可调用对象放在堆上
+/// WithExpired构造的任务还带一个过期处理，和任务本身放在一起，线程池队列里每项只占一个Task
+class Task {
+public:
+    static const size_t INLINE_SIZE = 48;
+
+    Task() noexcept : ops_(nullptr) {}
+    Task(std::nullptr_t) noexcept : ops_(nullptr) {}
+
+    template<class F, class Fn = typename std::decay<F>::type,
+             class = typename std::enable_if<!std::is_same<Fn, Task>::value>::type>
+    Task(F&& f) : ops_(nullptr) {
+        Init_<Fn>(std::forward<F>(f), std::integral_constant<bool, IsInline_<Fn>()>());
+    }
+
+    Task(Task&& other) noexcept : ops_(other.ops_) {
+        if(ops_) {
+            Move_(other);
+            other.ops_ = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if(this != &other) {
+            Reset_();
+            if(other.ops_) {
+                ops_ = other.ops_;
+                Move_(other);
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task& operator=(std::nullptr_t) noexcept {
+        Reset_();
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    /// 执行时调用f，过了截止时间时调用Expire()，也就是e
+    template<class F, class E>
+    static Task WithExpired(F&& f, E&& e) {
+        return Task(Expirable_<typename std::decay<F>::type, typename std::decay<E>::type>{
+            std::forward<F>(f), std::forward<E>(e) });
+    }
+
+    ~Task() { Reset_(); }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    void operator()() {
+        assert(ops_);
+        ops_->call(storage_);
+    }
+
+    /// 执行过期处理，不是WithExpired构造的任务什么也不做
+    void Expire() {
+        assert(ops_);
+        ops_->expire(storage_);
+    }
+
+    /// 可调用对象是否放在对象内部（测试用）
+    bool IsInline() const { return ops_ && ops_->isInline; }
+
+private:
+    /// 不同类型的可调用对象各有一组操作函数，对象里只记一个指针
+    struct Ops {
+        void (*call)(void* storage);
+        void (*expire)(void* storage);
+        void (*move)(void* dst, void* src);     /// 移动到dst并析构src
+        void (*destroy)(void* storage);
+        bool isInline;
+        bool trivial;           /// 放在内部且可以直接复制字节（只捕获指针和整数），移动和析构不用调用函数
+    };
+
+    template<class F, class E>
+    struct Expirable_ {
+        F run;
+        E expired;
+        void operator()() { run(); }
+        void Expire() { expired(); }
+    };
+
+    template<class Fn>
+    static auto Expire_(Fn& fn, int) -> decltype(fn.Expire(), void()) { fn.Expire(); }
+    template<class Fn>
+    static void Expire_(Fn&, long) {}
+
+    template<class Fn>
+    static constexpr bool IsInline_() {
+        return sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(std::max_align_t)
+               && std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template<class Fn>
+    struct InlineOps {
+        static Fn* Get(void* storage) { return std::launder(static_cast<Fn*>(storage)); }
+        static void Call(void* storage) { (*Get(storage))(); }
+        static void Expire(void* storage) { Expire_(*Get(storage), 0); }
+        static void Move(void* dst, void* src) {
+            ::new(dst) Fn(std::move(*Get(src)));
+            Get(src)->~Fn();
+        }
+        static void Destroy(void* storage) { Get(storage)->~Fn(); }
+        static constexpr Ops OPS = { Call, Expire, Move, Destroy, true,
+                                     std::is_trivially_copyable<Fn>::value };
+    };
+
+    /// 对象内部只放一个指针，移动时不复制可调用对象
+    template<class Fn>
+    struct HeapOps {
+        static Fn*& Get(void* storage) { return *std::launder(static_cast<Fn**>(storage)); }
+        static void Call(void* storage) { (*Get(storage))(); }
+        static void Expire(void* storage) { Expire_(*Get(storage), 0); }
+        static void Move(void* dst, void* src) { ::new(dst) Fn*(Get(src)); }
+        static void Destroy(void* storage) { delete Get(storage); }
+        static constexpr Ops OPS = { Call, Expire, Move, Destroy, false, false };
+    };
+
+    template<class Fn, class F>
+    void Init_(F&& f, std::true_type) {
+        ::new(static_cast<void*>(storage_)) Fn(std::forward<F>(f));
+        ops_ = &InlineOps<Fn>::OPS;
+    }
+
+    template<class Fn, class F>
+    void Init_(F&& f, std::false_type) {
+        ::new(static_cast<void*>(storage_)) Fn*(new Fn(std::forward<F>(f)));
+        ops_ = &HeapOps<Fn>::OPS;
+    }
+
+    /// 线程池里一个任务从加入到执行要移动好几次，常见的小任务直接复制字节
+    void Move_(Task& other) noexcept {
+        if(ops_->trivial) {
+            memcpy(storage_, other.storage_, INLINE_SIZE);
+        } else {
+            ops_->move(storage_, other.storage_);
+        }
+    }
+
+    void Reset_() {
+        if(ops_) {
+            if(!ops_->trivial) { ops_->destroy(storage_); }
+            ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[INLINE_SIZE];
+    const Ops* ops_;
+};
+
+#endif //TASK_H
@@ -0,0 +1,93 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-15
+ * @copyleft Apache 2.0
+ */
+
+#ifndef TASKQUEUE_H
+#define TASKQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <stddef.h>
+#include <assert.h>
+
+/// 有界的无锁多生产者多消费者队列（Vyukov的环形队列）
+/// 每个槽带一个序号，生产者/消费者各自CAS一个位置计数来占槽，不用锁；满了Push返回false，空了Pop返回false
+/// 线程池里每个工作线程一个，外面的线程往里放任务，本线程和来偷任务的线程从里面取
+template<class T>
+class TaskQueue {
+public:
+    /// capacity 必须是2的幂
+    explicit TaskQueue(size_t capacity): mask_(capacity - 1), cells_(new Cell[capacity]) {
+        assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+        for(size_t i = 0; i < capacity; i++) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+        pushPos_.store(0, std::memory_order_relaxed);
+        popPos_.store(0, std::memory_order_relaxed);
+    }
+
+    TaskQueue(const TaskQueue&) = delete;
+    TaskQueue& operator=(const TaskQueue&) = delete;
+
+    /// 只有占到槽以后才从item移走，失败时item不变
+    bool Push(T& item) {
+        Cell* cell;
+        size_t pos = pushPos_.load(std::memory_order_relaxed);
+        while(true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if(diff == 0) {
+                if(pushPos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) { break; }
+            }
+            else if(diff < 0) { return false; }     /// 槽里还是上一圈没取走的任务，队列满了
+            else { pos = pushPos_.load(std::memory_order_relaxed); }
+        }
+        cell->item = std::move(item);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& item) {
+        Cell* cell;
+        size_t pos = popPos_.load(std::memory_order_relaxed);
+        while(true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if(diff == 0) {
+                if(popPos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) { break; }
+            }
+            else if(diff < 0) { return false; }     /// 槽还没放进任务，队列空了
+            else { pos = popPos_.load(std::memory_order_relaxed); }
+        }
+        item = std::move(cell->item);
+        cell->item = T();       /// 任务捕获的资源不留在槽里
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// 大致的任务数，只用来挑队列
+    size_t Size() const {
+        size_t push = pushPos_.load(std::memory_order_relaxed);
+        size_t pop = popPos_.load(std::memory_order_relaxed);
+        return push > pop ? push - pop : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    /// 两个位置计数分开放在不同的缓存行，生产者和消费者互不干扰
+    alignas(64) std::atomic<size_t> pushPos_;
+    alignas(64) std::atomic<size_t> popPos_;
+};
+
+#endif //TASKQUEUE_H
@@ -0,0 +1,276 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-15
+ * @copyleft Apache 2.0
+ */
+#include "threadpool.h"
+
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include "../log/log.h"
+
+thread_local ThreadPool::Pool* ThreadPool::localPool_ = nullptr;
+thread_local size_t ThreadPool::localId_ = 0;
+
+ThreadPool::Pool::Pool(size_t threadCount, bool affinity):
+        affinity(affinity), core(threadCount), timed(false), maxThreads(threadCount), targetWaitNs(0), idleNs(0),
+        threads(threadCount), nextId(threadCount), lastPopNs(0), backlogNs(0), lastGrowNs(0), grown(0), shrunk(0),
+        next(0), overflowSize(0), started(0), expired(0), waitNs(0), maxWaitNs(0),
+        pending(0), sleepers(0), isClosed(false) {
+    for(size_t i = 0; i < threadCount; i++) {
+        queues.emplace_back(new TaskQueue<Entry>(QUEUE_SIZE));
+        workers.emplace_back(new Worker());
+    }
+}
+
+ThreadPool::ThreadPool(size_t threadCount, bool affinity, bool pinCpu):
+        pool_(std::make_shared<Pool>(threadCount, affinity)) {
+    assert(threadCount > 0);
+    cpu_set_t set;
+    if(pinCpu && sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &set)) { pool_->cpus.push_back(cpu); }
+        }
+    }
+    for(size_t i = 0; i < threadCount; i++) {
+        std::thread(Run_, pool_, i).detach();
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    if(static_cast<bool>(pool_)) {
+        {
+            std::lock_guard<std::mutex> locker(pool_->mtx);
+            pool_->isClosed = true;
+        }
+        pool_->cond.notify_all();
+        for(auto& worker: pool_->workers) {
+            { std::lock_guard<std::mutex> locker(worker->mtx); }
+            worker->cond.notify_one();
+        }
+    }
+}
+
+void ThreadPool::Push_(Task&& task, size_t key, int timeoutMS) {
+    assert(pool_);
+    Pool* pool = pool_.get();
+    const size_t n = pool->queues.size();
+    const int64_t now = timeoutMS > 0 || pool->timed.load(std::memory_order_relaxed) ? NowNs_() : 0;
+    Entry entry = { std::move(task), now, timeoutMS > 0 ? now + static_cast<int64_t>(timeoutMS) * 1000000 : 0 };
+    size_t id;
+    if(key != NO_KEY) { id = key % n; }
+    else if(localPool_ == pool) { id = localId_ % n; }
+    else {
+        /// 不用原子加：几个线程同时加任务时选到同一个队列也没关系
+        id = pool->next.load(std::memory_order_relaxed);
+        pool->next.store(id + 1, std::memory_order_relaxed);
+        id %= n;
+    }
+    /// 积压开始以后一直没有线程取到任务（都阻塞了），加线程
+    if(pool->pending.fetch_add(1) == 0) {
+        if(now > 0) { pool->backlogNs.store(now, std::memory_order_relaxed); }
+    } else if(now > 0 && pool->maxThreads.load(std::memory_order_relaxed) > pool->core
+            && now - std::max(pool->lastPopNs.load(), pool->backlogNs.load()) > pool->targetWaitNs.load()) {
+        Grow_(pool_, now);
+    }
+    bool pushed = false;
+    if(pool->affinity) {
+        Worker& worker = *pool->workers[id];
+        worker.queued.fetch_add(1);
+        pushed = pool->queues[id]->Push(entry);
+        if(!pushed) { worker.queued.fetch_sub(1); }
+    } else {
+        /// 已经有任务在溢出队列里就说明各个队列都满了，不再挨个试
+        for(size_t i = 0; i < n && !pushed && pool->overflowSize.load(std::memory_order_relaxed) == 0; i++) {
+            pushed = pool->queues[(id + i) % n]->Push(entry);
+        }
+        /// 外面的线程加得比工作线程取得快，先让出CPU让工作线程取走一些，还是满的才进溢出队列
+        if(!pushed && localPool_ != pool) {
+            std::this_thread::yield();
+            for(size_t i = 0; i < n && !pushed; i++) {
+                pushed = pool->queues[(id + i) % n]->Push(entry);
+            }
+        }
+    }
+    if(!pushed) {
+        std::lock_guard<std::mutex> locker(pool->overflowMtx);
+        pool->overflow.push_back(std::move(entry));
+        pool->overflowSize.store(pool->overflowSize.load(std::memory_order_relaxed) + 1);
+    }
+    /// 亲和模式下叫醒队列的主人，进了溢出队列的任务也由它来取；主人在忙时叫醒一个临时线程
+    if(pool->affinity && pool->workers[id]->sleeping.load()) {
+        Worker& worker = *pool->workers[id];
+        { std::lock_guard<std::mutex> locker(worker.mtx); }
+        worker.cond.notify_one();
+    }
+    /// 都在空转或忙的时候不用加锁，也不用notify
+    else if(pool->sleepers.load() > 0) {
+        { std::lock_guard<std::mutex> locker(pool->mtx); }
+        pool->cond.notify_one();
+    }
+}
+
+void ThreadPool::SetElastic(size_t maxThreads, int targetWaitMS, int idleMS) {
+    assert(pool_ && targetWaitMS > 0 && idleMS > 0);
+    pool_->targetWaitNs = static_cast<int64_t>(targetWaitMS) * 1000000;
+    pool_->idleNs = static_cast<int64_t>(idleMS) * 1000000;
+    pool_->maxThreads = std::max(maxThreads, pool_->core);
+    if(pool_->maxThreads.load() > pool_->core) { pool_->timed = true; }
+}
+
+void ThreadPool::EnableStats() {
+    assert(pool_);
+    pool_->timed = true;
+}
+
+void ThreadPool::Grow_(const std::shared_ptr<Pool>& pool, int64_t now) {
+    int64_t last = pool->lastGrowNs.load();
+    if(now - last < pool->targetWaitNs.load() || !pool->lastGrowNs.compare_exchange_strong(last, now)) {
+        return;
+    }
+    size_t n = pool->threads.load();
+    do {
+        if(n >= pool->maxThreads.load() || pool->isClosed) { return; }
+    } while(!pool->threads.compare_exchange_weak(n, n + 1));
+    pool->grown.fetch_add(1);
+    std::thread(Run_, pool, pool->nextId.fetch_add(1)).detach();
+    LOG_INFO("ThreadPool grow: %zu threads, %zu pending", n + 1, pool->pending.load());
+}
+
+ThreadPool::Stats ThreadPool::TakeStats() {
+    Stats stats = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    if(!pool_) { return stats; }
+    stats.depth = pool_->pending.load();
+    stats.tasks = pool_->started.exchange(0);
+    int64_t wait = pool_->waitNs.exchange(0);
+    stats.avgWaitUs = stats.tasks > 0 ? wait / static_cast<int64_t>(stats.tasks) / 1000 : 0;
+    stats.maxWaitUs = pool_->maxWaitNs.exchange(0) / 1000;
+    stats.expired = pool_->expired.exchange(0);
+    stats.threads = pool_->threads.load();
+    stats.grown = pool_->grown.load();
+    stats.shrunk = pool_->shrunk.load();
+    return stats;
+}
+
+bool ThreadPool::Pool::Pop(size_t id, Entry& entry, int64_t* now) {
+    const size_t n = queues.size();
+    const size_t tries = affinity && !IsElastic(id) ? 1 : n;
+    bool got = false;
+    for(size_t i = 0; i < tries && !got; i++) {
+        size_t q = (id + i) % n;
+        got = queues[q]->Pop(entry);
+        if(got && affinity) { workers[q]->queued.fetch_sub(1); }
+    }
+    if(!got && overflowSize.load() > 0) {
+        std::lock_guard<std::mutex> locker(overflowMtx);
+        if(!overflow.empty()) {
+            entry = std::move(overflow.front());
+            overflow.pop_front();
+            got = true;
+            /// 顺便搬一批到自己的队列，积压的时候不用每个任务都加一次锁
+            size_t moved = 0;
+            while(!IsElastic(id) && moved < OVERFLOW_BATCH && !overflow.empty()) {
+                if(affinity) { workers[id]->queued.fetch_add(1); }
+                if(!queues[id]->Push(overflow.front())) {
+                    if(affinity) { workers[id]->queued.fetch_sub(1); }
+                    break;
+                }
+                overflow.pop_front();
+                moved++;
+            }
+            overflowSize.fetch_sub(1 + moved);
+        }
+    }
+    if(!got) { return false; }
+    pending.fetch_sub(1);
+    if(entry.enqueueNs == 0) {
+        *now = 0;
+        return true;
+    }
+    *now = NowNs_();
+    if(!timed.load(std::memory_order_relaxed)) { return true; }    /// 只为截止时间打的时间戳
+    lastPopNs.store(*now, std::memory_order_relaxed);
+    int64_t wait = *now - entry.enqueueNs;
+    started.fetch_add(1, std::memory_order_relaxed);
+    waitNs.fetch_add(wait, std::memory_order_relaxed);
+    int64_t max = maxWaitNs.load(std::memory_order_relaxed);
+    while(wait > max && !maxWaitNs.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {}
+    return true;
+}
+
+bool ThreadPool::Pool::HasWork(size_t id) const {
+    if(affinity && !IsElastic(id)) { return workers[id]->queued.load() > 0 || overflowSize.load() > 0; }
+    return pending.load() > 0;
+}
+
+void ThreadPool::Run_(std::shared_ptr<Pool> pool, size_t id) {
+    localPool_ = pool.get();
+    localId_ = id;
+    if(!pool->cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pool->cpus[id % pool->cpus.size()], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    Entry entry;
+    int64_t now = 0;
+    int idle = 0;
+    while(true) {
+        if(pool->Pop(id, entry, &now)) {
+            /// 取到的任务已经等了太久，后面还有积压，加线程
+            if(now > 0 && pool->maxThreads.load(std::memory_order_relaxed) > pool->core && pool->pending.load() > 0
+                    && now - entry.enqueueNs > pool->targetWaitNs.load()) {
+                Grow_(pool, now);
+            }
+            if(entry.deadlineNs > 0 && now > entry.deadlineNs) {
+                /// 过期的任务不做，过载时不把时间花在已经没人等的请求上
+                pool->expired.fetch_add(1, std::memory_order_relaxed);
+                entry.task.Expire();
+            } else {
+                entry.task();
+            }
+            entry.task = nullptr;
+            idle = 0;
+            continue;
+        }
+        /// 关闭后把剩下的（自己能取的）任务做完再退出
+        if(pool->isClosed && !pool->HasWork(id)) { break; }
+        if(++idle < SPIN_COUNT || pool->HasWork(id)) {
+            std::this_thread::yield();
+            continue;
+        }
+        if(!Park_(pool.get(), id)) {
+            /// 临时线程空闲够久了，退出
+            size_t n = pool->threads.fetch_sub(1) - 1;
+            pool->shrunk.fetch_add(1);
+            LOG_INFO("ThreadPool shrink: %zu threads", n);
+            break;
+        }
+        idle = 0;
+    }
+    localPool_ = nullptr;
+}
+
+/// 先改自己的睡眠标记再检查有没有任务，Push_先加计数再读睡眠标记，两边至少有一边能看到对方
+bool ThreadPool::Park_(Pool* pool, size_t id) {
+    auto ready = [pool, id] { return pool->HasWork(id) || pool->isClosed; };
+    if(pool->affinity && !pool->IsElastic(id)) {
+        Worker& worker = *pool->workers[id];
+        std::unique_lock<std::mutex> locker(worker.mtx);
+        worker.sleeping.store(true);
+        worker.cond.wait(locker, ready);
+        worker.sleeping.store(false);
+        return true;
+    }
+    std::unique_lock<std::mutex> locker(pool->mtx);
+    pool->sleepers.fetch_add(1);
+    bool woken = true;
+    if(pool->IsElastic(id)) {
+        woken = pool->cond.wait_for(locker, std::chrono::nanoseconds(pool->idleNs.load()), ready);
+    } else {
+        pool->cond.wait(locker, ready);
+    }
+    pool->sleepers.fetch_sub(1);
+    return woken;
+}
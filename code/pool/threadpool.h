@@ -2,8 +2,16 @@
  * @Author       : mark
  * @Date         : 2020-06-15
  * @copyleft Apache 2.0
- */ 
+ */
 /// 线程池类
+/// 每个工作线程一个无锁队列，AddTask轮流往各个队列里放（工作线程自己加的任务放进自己的队列），
+/// 队列都满了先让出一次CPU再试，还满才放进加锁的全局溢出队列；工作线程先取自己的队列，空了去别的队列偷，再看溢出队列
+/// 没有任务时先让出CPU空转一会儿，还没有才睡眠；只有有线程在睡眠时AddTask才加锁唤醒
+/// 不同性质的工作（静态响应、数据库、大文件传输）各用一个线程池，互不排队，见WebServer
+/// 亲和模式下带key的任务总放进同一个工作线程的队列，也不互相偷，同一个连接的状态一直在同一个CPU的缓存里
+/// 弹性模式下任务排队等待超过目标时间就临时加线程（工作线程都阻塞在数据库或缺页上时也能加），
+/// 临时线程只帮常驻线程取任务，空闲一段时间后自己退出
+/// 任务可以带截止时间：排队超过截止时间的任务不再执行，改为执行它的过期处理（比如关闭早已放弃等待的连接）
 
 
 #ifndef THREADPOOL_H
@@ -12,61 +20,166 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
 #include <thread>
 #include <functional>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <assert.h>
+#include "taskqueue.h"
+#include "task.h"
+
 class ThreadPool {
 public:
-    explicit ThreadPool(size_t threadCount = 8): pool_(std::make_shared<Pool>()) {
-            assert(threadCount > 0);
-            for(size_t i = 0; i < threadCount; i++) {
-                std::thread([pool = pool_] {
-                    std::unique_lock<std::mutex> locker(pool->mtx);
-                    while(true) {
-                        if(!pool->tasks.empty()) {
-                            auto task = std::move(pool->tasks.front());
-                            pool->tasks.pop();
-                            locker.unlock();
-                            task();
-                            locker.lock();
-                        } 
-                        else if(pool->isClosed) break;
-                        else pool->cond.wait(locker);
-                    }
-                }).detach();
-            }
-    }
+    /// affinity 亲和模式：工作线程只取自己的队列和溢出队列，不偷别的队列的任务
+    /// pinCpu 每个工作线程绑定到一个CPU上（按进程允许的CPU轮流分配），绑定失败时照常运行
+    explicit ThreadPool(size_t threadCount = 8, bool affinity = false, bool pinCpu = false);
 
     ThreadPool() = default;
 
     ThreadPool(ThreadPool&&) = default;
-    
-    ~ThreadPool() {
-        if(static_cast<bool>(pool_)) {
-            {
-                std::lock_guard<std::mutex> locker(pool_->mtx);
-                pool_->isClosed = true;
-            }
-            pool_->cond.notify_all();
-        }
-    }
 
+    /// 不等待线程退出：线程执行完剩下的任务后自己退出
+    ~ThreadPool();
+
+    /// 任务包装成Task：不超过Task::INLINE_SIZE的可调用对象从加入到执行都不分配内存
     template<class F>
     void AddTask(F&& task) {
-        {
-            std::lock_guard<std::mutex> locker(pool_->mtx);
-            pool_->tasks.emplace(std::forward<F>(task));
+        Push_(Task(std::forward<F>(task)), NO_KEY);
+    }
+
+    /// key相同的任务（比如同一个连接的fd）先放进同一个工作线程的队列；亲和模式下只放这个队列，满了才进溢出队列
+    template<class F>
+    void AddTask(size_t key, F&& task) {
+        Push_(Task(std::forward<F>(task)), key);
+    }
+
+    /// 带截止时间的任务：排队超过timeoutMS还没开始执行就丢弃，执行onExpired代替；timeoutMS不大于0时不过期
+    template<class F, class E>
+    void AddTask(size_t key, int timeoutMS, F&& task, E&& onExpired) {
+        if(timeoutMS > 0) {
+            Push_(Task::WithExpired(std::forward<F>(task), std::forward<E>(onExpired)), key, timeoutMS);
+        } else {
+            Push_(Task(std::forward<F>(task)), key);
         }
-        pool_->cond.notify_one();
     }
 
+    /// 开启弹性模式：任务等待超过targetWaitMS时加线程，最多到maxThreads；临时线程空闲idleMS后退出
+    /// 构造后、加任务前调用；maxThreads不大于构造时的线程数表示不扩容
+    void SetElastic(size_t maxThreads, int targetWaitMS, int idleMS);
+
+    /// 队列深度和任务排队等待的时间，等待时间从加入到开始执行
+    struct Stats {
+        size_t depth;           /// 当前还没开始执行的任务数
+        size_t tasks;           /// 上次TakeStats以来开始执行的任务数
+        int64_t avgWaitUs;
+        int64_t maxWaitUs;
+        size_t expired;         /// 上次TakeStats以来过了截止时间被丢弃的任务数
+        size_t threads;         /// 当前线程数
+        size_t grown;           /// 累计加过的线程数
+        size_t shrunk;          /// 累计退出的临时线程数
+    };
+
+    /// 开始统计任务数和等待时间，构造后、加任务前调用；不开启时TakeStats只有depth、expired和线程数
+    void EnableStats();
+
+    /// 取出上次调用以来的统计，等待时间的累计清零
+    Stats TakeStats();
+
+    /// 每个工作线程队列的容量
+    static const size_t QUEUE_SIZE = 1024;
+    /// 从溢出队列取任务时一次搬到自己队列的个数
+    static const size_t OVERFLOW_BATCH = 64;
+    /// 没有任务时睡眠前空转的次数
+    static const int SPIN_COUNT = 8;
+
 private:
+    typedef std::chrono::steady_clock Clock;
+
+    /// 队列里的一项：任务（过期处理也在里面）、加入的时间和截止时间（0表示不过期）
+    /// 不统计、不扩容、也没有截止时间的任务不读时钟，enqueueNs为0
+    struct Entry {
+        Task task;
+        int64_t enqueueNs = 0;
+        int64_t deadlineNs = 0;
+    };
+
+    static int64_t NowNs_() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    static const size_t NO_KEY = SIZE_MAX;
+
+    /// 亲和模式下每个工作线程单独睡眠和唤醒，任务只能由队列的主人执行，不能随便叫醒一个线程
+    struct Worker {
+        std::atomic<size_t> queued{0};      /// 放进这个线程队列还没取走的任务数，在放进队列前加一
+        std::atomic<bool> sleeping{false};
+        std::mutex mtx;
+        std::condition_variable cond;
+    };
+
     struct Pool {
+        Pool(size_t threadCount, bool affinity);
+
+        /// 按 自己的队列、别的线程的队列、溢出队列 的顺序取一个任务，并记下它等待的时间；亲和模式下不取别的线程的队列
+        /// now带回取到任务的时间，任务没有时间戳时为0
+        bool Pop(size_t id, Entry& entry, int64_t* now);
+        /// 有没有这个线程能取的任务
+        bool HasWork(size_t id) const;
+        /// 编号不小于core的是临时线程
+        bool IsElastic(size_t id) const { return id >= core; }
+
+        const bool affinity;
+        const size_t core;                  /// 常驻线程数，也是队列数
+        std::atomic<bool> timed;            /// 统计或弹性模式：每个任务都打时间戳
+        std::atomic<size_t> maxThreads;
+        std::atomic<int64_t> targetWaitNs;
+        std::atomic<int64_t> idleNs;
+        std::atomic<size_t> threads;
+        std::atomic<size_t> nextId;         /// 下一个临时线程的编号
+        std::atomic<int64_t> lastPopNs;     /// 最近一次取到任务的时间，太久没有进展说明线程都阻塞了
+        std::atomic<int64_t> backlogNs;     /// 这一轮积压开始的时间（pending从0变成1）
+        std::atomic<int64_t> lastGrowNs;
+        std::atomic<size_t> grown;
+        std::atomic<size_t> shrunk;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<int> cpus;              /// 绑定CPU时按顺序分给各个工作线程，空表示不绑定
+
+        std::vector<std::unique_ptr<TaskQueue<Entry>>> queues;
+        std::atomic<size_t> next;           /// 外面的线程轮流选队列
+
+        std::mutex overflowMtx;
+        std::deque<Entry> overflow;
+        std::atomic<size_t> overflowSize;
+
+        std::atomic<size_t> started;
+        std::atomic<size_t> expired;
+        std::atomic<int64_t> waitNs;
+        std::atomic<int64_t> maxWaitNs;
+
+        /// pending 已加入还没被取走的任务数，在放进队列前加一；sleepers 正在睡眠或准备睡眠的线程数
+        /// 两边都是先改自己的计数再读对方的，AddTask看到sleepers为0时，准备睡眠的线程一定能看到新任务
+        std::atomic<size_t> pending;
+        std::atomic<size_t> sleepers;
         std::mutex mtx;
         std::condition_variable cond;
-        bool isClosed;
-        std::queue<std::function<void()>> tasks;
+        std::atomic<bool> isClosed;
     };
+
+    void Push_(Task&& task, size_t key, int timeoutMS = 0);
+    static void Run_(std::shared_ptr<Pool> pool, size_t id);
+    /// 睡眠到有任务为止；临时线程最多睡idleNs，超时且没有任务返回false
+    static bool Park_(Pool* pool, size_t id);
+    /// 加一个临时线程，按目标等待时间限速，到上限时不加
+    static void Grow_(const std::shared_ptr<Pool>& pool, int64_t now);
+
     std::shared_ptr<Pool> pool_;
+
+    /// 当前线程是哪个线程池的第几个工作线程，工作线程里加的任务放进自己的队列
+    static thread_local Pool* localPool_;
+    static thread_local size_t localId_;
 };
 
 
@@ -0,0 +1,86 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-17
+ * @copyleft Apache 2.0
+ */
+#ifndef CONN_SLAB_H
+#define CONN_SLAB_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <assert.h>
+
+#include "../http/httpconn.h"
+#include "../timer/timingwheel.h"
+
+/// 以fd为下标的连接槽位数组，替代unordered_map<int, HttpConn>，查找就是一次数组寻址
+/// 槽位数组一次性分配到MAX_FD；HttpConn在该fd第一次使用时创建，之后随fd一起复用
+/// 每个槽位带一个代数(generation)：新连接占用槽位和连接关闭时都会加一，
+/// 定时器回调、线程池任务记下(fd, gen)，执行时代数对不上说明连接已经关闭或fd被复用，直接丢弃
+class ConnSlab {
+public:
+    explicit ConnSlab(size_t maxFd): slots_(maxFd) {}
+
+    ~ConnSlab() = default;
+
+    /// 新连接占用fd对应的槽位，返回连接对象，gen带回本次连接的代数（只在accept的线程调用）
+    /// 超出槽位数组的fd必须在accept时就拒绝
+    HttpConn* Acquire(int fd, uint32_t* gen) {
+        assert(fd >= 0 && static_cast<size_t>(fd) < slots_.size());
+        Slot& slot = slots_[fd];
+        if(!slot.conn) { slot.conn.reset(new HttpConn()); }
+        *gen = ++slot.gen;
+        return slot.conn.get();
+    }
+
+    /// 连接关闭，代数加一，之前记下的(fd, gen)全部失效
+    void Release(int fd) {
+        assert(fd >= 0 && static_cast<size_t>(fd) < slots_.size());
+        slots_[fd].gen++;
+    }
+
+    /// 当前占用fd的连接，epoll事件一定属于当前连接，所以不需要检查代数
+    HttpConn* Get(int fd) const {
+        if(fd < 0 || static_cast<size_t>(fd) >= slots_.size()) { return nullptr; }
+        return slots_[fd].conn.get();
+    }
+
+    /// 代数一致才返回连接，否则返回nullptr
+    HttpConn* Get(int fd, uint32_t gen) const {
+        if(fd < 0 || static_cast<size_t>(fd) >= slots_.size()) { return nullptr; }
+        const Slot& slot = slots_[fd];
+        if(slot.gen.load(std::memory_order_acquire) != gen) { return nullptr; }
+        return slot.conn.get();
+    }
+
+    /// 槽位里侵入式的时间轮结点，只在事件循环线程里使用
+    WheelNode* TimerNode(int fd) {
+        assert(fd >= 0 && static_cast<size_t>(fd) < slots_.size());
+        return &slots_[fd].timerNode;
+    }
+
+    uint32_t Generation(int fd) const {
+        assert(fd >= 0 && static_cast<size_t>(fd) < slots_.size());
+        return slots_[fd].gen.load(std::memory_order_acquire);
+    }
+
+    /// 遍历所有创建过的连接对象
+    template<class F>
+    void ForEach(F&& func) {
+        for(auto& slot: slots_) {
+            if(slot.conn) { func(slot.conn.get()); }
+        }
+    }
+
+private:
+    struct Slot {
+        std::unique_ptr<HttpConn> conn;
+        std::atomic<uint32_t> gen{0};
+        WheelNode timerNode;
+    };
+
+    std::vector<Slot> slots_;
+};
+
+#endif //CONN_SLAB_H
@@ -5,13 +5,28 @@
  */
 
 #include "epoller.h"
+#include "uringepoller.h"
 
 Epoller::Epoller(int maxEvent):epollFd_(epoll_create(512)), events_(maxEvent){
     assert(epollFd_ >= 0 && events_.size() > 0);
 }
 
+Epoller::Epoller(int maxEvent, int epollFd):epollFd_(epollFd), events_(maxEvent){
+    assert(events_.size() > 0);
+}
+
 Epoller::~Epoller() {
-    close(epollFd_);
+    if(epollFd_ >= 0) { close(epollFd_); }
+}
+
+Epoller* Epoller::Create(bool useIoUring, int maxEvent) {
+    if(useIoUring) {
+        if(UringEpoller::IsSupported()) {
+            return new UringEpoller(maxEvent);
+        }
+        LOG_WARN("io_uring not supported, fall back to epoll");
+    }
+    return new Epoller(maxEvent);
 }
 
 bool Epoller::AddFd(int fd, uint32_t events) {
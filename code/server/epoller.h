@@ -10,28 +10,56 @@
 #include <fcntl.h>  // fcntl()
 #include <unistd.h> // close()
 #include <assert.h> // close()
+#include <sys/uio.h>  // iovec
 #include <vector>
+#include <memory>
 #include <errno.h>
 
 class Epoller {
 public:
     explicit Epoller(int maxEvent = 1024);
 
-    ~Epoller();
+    virtual ~Epoller();
 
-    bool AddFd(int fd, uint32_t events);
+    /// 按配置创建I/O后端，useIoUring为true且内核支持时返回io_uring后端，否则返回epoll
+    static Epoller* Create(bool useIoUring, int maxEvent = 1024);
 
-    bool ModFd(int fd, uint32_t events);
+    virtual bool AddFd(int fd, uint32_t events);
 
-    bool DelFd(int fd);
+    virtual bool ModFd(int fd, uint32_t events);
 
-    int Wait(int timeoutMs = -1);
+    virtual bool DelFd(int fd);
+
+    virtual int Wait(int timeoutMs = -1);
 
     int GetEventFd(size_t i) const;
 
     uint32_t GetEvents(size_t i) const;
-        
-private:
+
+    /* 完成模式（io_uring）：由后端直接收发数据，事件返回时数据已经收到或者已经发出，不用再调用readv/writev */
+
+    /// 后端是否支持Recv/Send
+    virtual bool CanComplete() const { return false; }
+
+    /// 提交一次接收，完成时返回EPOLLIN事件，GetRecvData(i)是收到的数据；fd要先AddFd
+    virtual bool Recv(int fd) { return false; }
+
+    /// 提交一次发送，完成时返回EPOLLOUT事件；owners[i]为空的段提交前复制一份，否则由owners[i]保证内存在发完之前有效
+    /// more为true时后面还有数据（MSG_MORE）
+    virtual bool Send(int fd, const struct iovec* iov, const std::shared_ptr<const void>* owners, int cnt, bool more) {
+        return false;
+    }
+
+    /// 事件i是Recv/Send的完成（而不是就绪通知）时返回true，bytes带回收发的字节数，0或负数（-errno）表示连接已断开或出错
+    virtual bool GetCompletion(size_t i, int* bytes) const { return false; }
+
+    /// Recv完成时收到的数据，下一次Wait之前有效
+    virtual const char* GetRecvData(size_t i) const { return nullptr; }
+
+protected:
+    /// 给其它后端使用，只复用events_结果数组，不创建epoll实例
+    Epoller(int maxEvent, int epollFd);
+
     int epollFd_;
 
     /// 在C++11 中，利用vector容器替换了以前的指针类型，更加安全
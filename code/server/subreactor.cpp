@@ -0,0 +1,269 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-17
+ * @copyleft Apache 2.0
+ */
+
+#include "subreactor.h"
+
+using namespace std;
+
+SubReactor::SubReactor(int id, int timeoutMS, uint32_t connEvent, bool useIoUring, ThreadPool* diskPool,
+                       ThreadPool* dbPool, int taskDeadlineMS):
+            id_(id), timeoutMS_(timeoutMS), connEvent_(connEvent & ~EPOLLONESHOT), isClose_(false),
+            listenFd_(-1), listenEvent_(0),
+            timer_(new TimingWheel()), epoller_(Epoller::Create(useIoUring)), diskPool_(diskPool),
+            dbPool_(dbPool), taskDeadlineMS_(taskDeadlineMS), users_(MAX_FD) {
+    wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(wakeupFd_ >= 0);
+    epoller_->AddFd(wakeupFd_, EPOLLIN);
+}
+
+SubReactor::~SubReactor() {
+    Stop();
+    close(wakeupFd_);
+    if(listenFd_ >= 0) { close(listenFd_); }
+}
+
+void SubReactor::Start() {
+    thread_ = std::thread(&SubReactor::Loop_, this);
+}
+
+void SubReactor::Stop() {
+    if(!thread_.joinable()) { return; }
+    isClose_ = true;
+    uint64_t one = 1;
+    ssize_t n = ::write(wakeupFd_, &one, sizeof(one));
+    (void)n;
+    thread_.join();
+}
+
+void SubReactor::QueueConn(int fd, const sockaddr_in& addr) {
+    {
+        lock_guard<mutex> locker(mtx_);
+        pendingConns_.emplace_back(fd, addr);
+    }
+    Wakeup_();
+}
+
+void SubReactor::Wakeup_() {
+    uint64_t one = 1;
+    if(::write(wakeupFd_, &one, sizeof(one)) != sizeof(one)) {
+        LOG_WARN("SubReactor[%d] wakeup error!", id_);
+    }
+}
+
+void SubReactor::SetListenFd(int listenFd, uint32_t listenEvent) {
+    assert(listenFd >= 0 && listenFd_ < 0);
+    listenFd_ = listenFd;
+    listenEvent_ = listenEvent;
+    epoller_->AddFd(listenFd_, listenEvent_ | EPOLLIN);
+}
+
+void SubReactor::Loop_() {
+    int timeMS = -1;
+    LOG_INFO("SubReactor[%d] start", id_);
+    while(!isClose_) {
+        if(timeoutMS_ > 0) {
+            timeMS = timer_->GetNextTick();
+        }
+        int eventCnt = epoller_->Wait(timeMS);
+        for(int i = 0; i < eventCnt; i++) {
+            int fd = epoller_->GetEventFd(i);
+            uint32_t events = epoller_->GetEvents(i);
+            if(fd == wakeupFd_) {
+                HandleWakeup_();
+            }
+            else if(fd == listenFd_) {
+                DealListen_();
+            }
+            else if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                assert(users_.Get(fd));
+                CloseConn_(users_.Get(fd));
+            }
+            else if(events & EPOLLIN) {
+                HttpConn* client = users_.Get(fd);
+                assert(client);
+                ExtentTime_(client);
+                OnRead_(client);
+            }
+            else if(events & EPOLLOUT) {
+                HttpConn* client = users_.Get(fd);
+                assert(client);
+                ExtentTime_(client);
+                OnWrite_(client, true);
+            } else {
+                LOG_ERROR("Unexpected event");
+            }
+        }
+    }
+    /// 退出前关闭本Reactor上的所有连接
+    users_.ForEach([](HttpConn* client) { client->Close(); });
+    LOG_INFO("SubReactor[%d] quit", id_);
+}
+
+/// 取出主Reactor投递过来的新连接，上本Reactor的epoll树；再取出预读完成和查完数据库的连接，继续写
+void SubReactor::HandleWakeup_() {
+    uint64_t cnt = 0;
+    ssize_t n = ::read(wakeupFd_, &cnt, sizeof(cnt));
+    (void)n;
+    vector<pair<int, sockaddr_in>> conns;
+    vector<pair<int, uint32_t>> prefetched;
+    vector<Verified> verified;
+    {
+        lock_guard<mutex> locker(mtx_);
+        conns.swap(pendingConns_);
+        prefetched.swap(prefetched_);
+        verified.swap(verified_);
+    }
+    /// 连接的关闭和fd的复用都只发生在本线程，代数对得上就还是发起预读的那个连接
+    for(auto& item: prefetched) {
+        if(users_.Get(item.first, item.second)) { epoller_->ModFd(item.first, connEvent_ | EPOLLOUT); }
+    }
+    /// 查数据库期间连接不在epoll和定时器上，交回后重新挂上
+    for(auto& item: verified) {
+        HttpConn* client = users_.Get(item.fd, item.gen);
+        if(!client) { continue; }
+        if(item.events == 0) {
+            LOG_WARN("Client[%d] request waited over %d ms, dropped", item.fd, taskDeadlineMS_);
+            CloseConn_(client);
+            continue;
+        }
+        ExtentTime_(client);
+        epoller_->AddFd(item.fd, connEvent_ | EPOLLIN);
+        if(item.events == EPOLLOUT) { OnWrite_(client, false); }
+    }
+    for(auto& item: conns) {
+        AddClient_(item.first, item.second);
+    }
+}
+
+/// 处理本Reactor监听socket上的新连接
+void SubReactor::DealListen_() {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    do {
+        int fd = accept4(listenFd_, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK);
+        if(fd <= 0) { return; }
+        else if(HttpConn::userCount >= MAX_FD || fd >= MAX_FD) {    /// fd超出连接槽位数组也拒绝
+            const char info[] = "Server busy!";
+            if(send(fd, info, sizeof(info) - 1, 0) < 0) {
+                LOG_WARN("send error to client[%d] error!", fd);
+            }
+            close(fd);
+            LOG_WARN("Clients is full!");
+            return;
+        }
+        AddClient_(fd, addr);
+    } while(listenEvent_ & EPOLLET);
+}
+
+void SubReactor::AddClient_(int fd, const sockaddr_in& addr) {
+    assert(fd > 0);
+    uint32_t gen = 0;
+    users_.Acquire(fd, &gen)->init(fd, addr);
+    if(timeoutMS_ > 0) {
+        timer_->add(users_.TimerNode(fd), timeoutMS_, [this, fd, gen]() {
+            HttpConn* client = users_.Get(fd, gen);
+            if(client) { CloseConn_(client); }
+        });
+    }
+    epoller_->AddFd(fd, EPOLLIN | connEvent_);
+    LOG_INFO("Client[%d] in SubReactor[%d]!", fd, id_);
+}
+
+void SubReactor::ExtentTime_(HttpConn* client) {
+    assert(client);
+    if(timeoutMS_ > 0) { timer_->adjust(users_.TimerNode(client->GetFd()), timeoutMS_); }
+}
+
+void SubReactor::CloseConn_(HttpConn* client) {
+    assert(client);
+    LOG_INFO("Client[%d] quit!", client->GetFd());
+    epoller_->DelFd(client->GetFd());
+    users_.Release(client->GetFd());
+    client->Close();
+}
+
+/// 读完请求直接在本线程处理并尝试写回，写不完才关注EPOLLOUT
+void SubReactor::OnRead_(HttpConn* client) {
+    assert(client);
+    int readErrno = 0;
+    ssize_t ret = client->read(&readErrno);
+    if(ret <= 0 && readErrno != EAGAIN) {
+        CloseConn_(client);
+        return;
+    }
+    if(client->process(static_cast<bool>(dbPool_))) {
+        OnWrite_(client, false);
+    } else if(client->WaitingVerify()) {
+        Verify_(client);
+    }
+}
+
+/// armedOut表示当前epoll上关注的是EPOLLOUT，写完后需要切回EPOLLIN
+void SubReactor::OnWrite_(HttpConn* client, bool armedOut) {
+    assert(client);
+    while(true) {
+        int writeErrno = 0;
+        ssize_t ret = client->write(&writeErrno);
+        if(client->IsCold()) {
+            /// 预读期间不关注读写事件（只剩EPOLLRDHUP），读完通过wakeupFd_交回本线程，关注EPOLLOUT继续写
+            int fd = client->GetFd();
+            uint32_t gen = users_.Generation(fd);
+            epoller_->ModFd(fd, connEvent_);
+            diskPool_->AddTask([this, fd, gen, prefetch = client->TakePrefetch()]() {
+                prefetch();
+                {
+                    lock_guard<mutex> locker(mtx_);
+                    prefetched_.emplace_back(fd, gen);
+                }
+                Wakeup_();
+            });
+            return;
+        }
+        if(client->ToWriteBytes() > 0) {
+            if(ret < 0 && writeErrno != EAGAIN) {
+                CloseConn_(client);
+                return;
+            }
+            /* 继续传输 */
+            if(!armedOut) { epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT); }
+            return;
+        }
+        /* 传输完成 */
+        if(!client->IsKeepAlive()) {
+            CloseConn_(client);
+            return;
+        }
+        if(!client->process(static_cast<bool>(dbPool_))) {
+            if(client->WaitingVerify()) {
+                Verify_(client);
+                return;
+            }
+            break;
+        }
+    }
+    if(armedOut) { epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLIN); }
+}
+
+/// 查询期间连接摘下epoll（连接断开的事件也不会来）和定时器，本线程不碰它，只有数据库线程在处理
+void SubReactor::Verify_(HttpConn* client) {
+    assert(client && dbPool_);
+    int fd = client->GetFd();
+    uint32_t gen = users_.Generation(fd);
+    epoller_->DelFd(fd);
+    timer_->del(users_.TimerNode(fd));
+    dbPool_->AddTask(fd, taskDeadlineMS_, [this, fd, gen]() {
+        HttpConn* client = users_.Get(fd, gen);
+        if(client) { Handback_(fd, gen, client->process() ? EPOLLOUT : EPOLLIN); }
+    }, [this, fd, gen]() { Handback_(fd, gen, 0); });
+}
+
+void SubReactor::Handback_(int fd, uint32_t gen, uint32_t events) {
+    {
+        lock_guard<mutex> locker(mtx_);
+        verified_.push_back({ fd, gen, events });
+    }
+    Wakeup_();
+}
@@ -0,0 +1,98 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-17
+ * @copyleft Apache 2.0
+ */
+#ifndef SUBREACTOR_H
+#define SUBREACTOR_H
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <unistd.h>      // close()
+#include <assert.h>
+#include <errno.h>
+#include <sys/eventfd.h> // eventfd()
+#include <sys/socket.h>  // accept4()
+#include <netinet/in.h>
+
+#include "epoller.h"
+#include "../log/log.h"
+#include "../timer/timingwheel.h"
+#include "../http/httpconn.h"
+#include "../pool/threadpool.h"
+#include "connslab.h"
+
+/// 子Reactor：一个线程一个事件循环，拥有自己的epoll、定时器和一部分用户连接
+/// 主Reactor只负责accept，新连接通过pendingConns_ + eventfd交给子Reactor，读写和业务处理都在本线程完成，不经过线程池
+/// 只有登录/注册的数据库查询交给数据库线程，查完同样通过eventfd交回本线程
+class SubReactor {
+public:
+    /// diskPool 冷文件预读用的磁盘IO线程池，多个Reactor共用，可以为nullptr
+    /// dbPool 查数据库用的线程池，多个Reactor共用，为nullptr时在本线程里查；taskDeadlineMS 查询任务排队的截止时间
+    SubReactor(int id, int timeoutMS, uint32_t connEvent, bool useIoUring = false, ThreadPool* diskPool = nullptr,
+               ThreadPool* dbPool = nullptr, int taskDeadlineMS = 0);
+
+    ~SubReactor();
+
+    void Start();
+
+    void Stop();
+
+    /// 主Reactor调用，把已经accept的连接放入待处理队列，并唤醒本Reactor
+    void QueueConn(int fd, const sockaddr_in& addr);
+
+    /// SO_REUSEPORT模式下给本Reactor一个独立的监听socket，由本线程自己accept
+    void SetListenFd(int listenFd, uint32_t listenEvent);
+
+private:
+    static const int MAX_FD = 65536;
+
+    void Loop_();
+    void HandleWakeup_();
+    void Wakeup_();
+    void DealListen_();
+    void AddClient_(int fd, const sockaddr_in& addr);
+
+    void ExtentTime_(HttpConn* client);
+    void CloseConn_(HttpConn* client);
+
+    void OnRead_(HttpConn* client);
+    void OnWrite_(HttpConn* client, bool armedOut);
+    /// 把等着查数据库的连接交给数据库线程
+    void Verify_(HttpConn* client);
+    /// 数据库线程调用，把查完的连接交回本线程
+    void Handback_(int fd, uint32_t gen, uint32_t events);
+
+    int id_;
+    int timeoutMS_;
+    uint32_t connEvent_;           /// 不带EPOLLONESHOT，只在读写兴趣切换时才ModFd
+    std::atomic<bool> isClose_;
+    int wakeupFd_;                 /// eventfd，主Reactor投递新连接、磁盘IO线程预读完成后写入唤醒
+    int listenFd_;                 /// 本Reactor自己的监听socket，-1表示由主Reactor accept
+    uint32_t listenEvent_;
+
+    std::unique_ptr<TimingWheel> timer_;
+    std::unique_ptr<Epoller> epoller_;
+    ThreadPool* diskPool_;
+    ThreadPool* dbPool_;
+    int taskDeadlineMS_;
+    ConnSlab users_;                            /// 只属于本Reactor的用户连接槽位
+
+    std::mutex mtx_;
+    std::vector<std::pair<int, sockaddr_in>> pendingConns_;
+    /// 预读完成的连接(fd, gen)，由本线程检查代数后再关注EPOLLOUT，磁盘IO线程不碰epoll
+    std::vector<std::pair<int, uint32_t>> prefetched_;
+    /// 查完数据库的连接，events是接下来要关注的事件，0表示排队超过截止时间没有查，关闭连接
+    struct Verified {
+        int fd;
+        uint32_t gen;
+        uint32_t events;
+    };
+    std::vector<Verified> verified_;
+    std::thread thread_;
+};
+
+#endif //SUBREACTOR_H
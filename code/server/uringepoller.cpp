@@ -0,0 +1,416 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-19
+ * @copyleft Apache 2.0
+ */
+
+#include "uringepoller.h"
+
+using namespace std;
+
+static int IoUringSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int IoUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete,
+                        unsigned flags, void* arg, size_t argSize) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, arg, argSize));
+}
+
+bool UringEpoller::IsSupported() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = IoUringSetup(4, &params);
+    if(fd < 0) { return false; }
+    close(fd);
+    /// Wait的超时依赖IORING_ENTER_EXT_ARG
+    return (params.features & IORING_FEAT_EXT_ARG) != 0;
+}
+
+UringEpoller::UringEpoller(int maxEvent): Epoller(maxEvent, -1), ringFd_(-1), sqTail_(0), pending_(0),
+        completions_(maxEvent) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd_ = IoUringSetup(maxEvent, &params);
+    assert(ringFd_ >= 0);
+    sqEntries_ = params.sq_entries;
+    /// 控制类请求（交还缓冲区、取消）成功时不产生完成事件，否则它们会把正在等待的Wait提前唤醒
+    controlFlags_ = (params.features & IORING_FEAT_CQE_SKIP) ? IOSQE_CQE_SKIP_SUCCESS : 0;
+
+    /* 映射SQ、CQ环和SQE数组 */
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(singleMmap) {
+        sqRingSize_ = cqRingSize_ = max(sqRingSize_, cqRingSize_);
+    }
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ringFd_, IORING_OFF_SQ_RING);
+    assert(sqRing_ != MAP_FAILED);
+    if(singleMmap) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ringFd_, IORING_OFF_CQ_RING);
+        assert(cqRing_ != MAP_FAILED);
+    }
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES));
+    assert(sqes_ != MAP_FAILED);
+
+    char* sq = static_cast<char*>(sqRing_);
+    char* cq = static_cast<char*>(cqRing_);
+    sqKHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqKTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqKMask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqKArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqKHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqKTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqKMask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sqTail_ = *sqKTail_;
+}
+
+UringEpoller::~UringEpoller() {
+    munmap(sqes_, sqesSize_);
+    if(cqRing_ != sqRing_) { munmap(cqRing_, cqRingSize_); }
+    munmap(sqRing_, sqRingSize_);
+    /// 只在服务器退出时析构，关闭io_uring取消所有在途的请求
+    close(ringFd_);
+    for(Registration& reg: regs_) { delete reg.sending; }
+}
+
+int UringEpoller::Submit_(unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+    int ret = IoUringEnter(ringFd_, toSubmit, minComplete, flags, arg, argSize);
+    return ret < 0 ? -errno : ret;
+}
+
+/// 取一个空闲的SQE，SQ满了就先把已有的提交掉（调用者持有mtx_）
+io_uring_sqe* UringEpoller::GetSqe_() {
+    unsigned head = __atomic_load_n(sqKHead_, __ATOMIC_ACQUIRE);
+    if(sqTail_ - head >= sqEntries_) {
+        int ret = Submit_(pending_, 0, 0, nullptr, 0);
+        if(ret > 0) { pending_ -= ret; }
+        head = __atomic_load_n(sqKHead_, __ATOMIC_ACQUIRE);
+        if(sqTail_ - head >= sqEntries_) {
+            LOG_ERROR("io_uring SQ full!");
+            return nullptr;
+        }
+    }
+    unsigned idx = sqTail_ & *sqKMask_;
+    io_uring_sqe* sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqKArray_[idx] = idx;
+    return sqe;
+}
+
+void UringEpoller::QueuePoll_(int fd, Registration& reg) {
+    io_uring_sqe* sqe = GetSqe_();
+    if(!sqe) { return; }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    /// 内核的poll本身就是单次触发，这里只保留事件位，ET/ONESHOT语义由本类处理
+    sqe->poll32_events = reg.events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI);
+    sqe->user_data = UserData_(KIND_POLL, fd, reg.gen);
+    __atomic_store_n(sqKTail_, ++sqTail_, __ATOMIC_RELEASE);
+    pending_++;
+    reg.armed = true;
+}
+
+void UringEpoller::QueueRemove_(int fd, Registration& reg) {
+    io_uring_sqe* sqe = GetSqe_();
+    if(!sqe) { return; }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = UserData_(KIND_POLL, fd, reg.gen);
+    sqe->flags = controlFlags_;
+    sqe->user_data = CONTROL_TAG;
+    __atomic_store_n(sqKTail_, ++sqTail_, __ATOMIC_RELEASE);
+    pending_++;
+    reg.armed = false;
+}
+
+/// 取消在途的RECV/SENDMSG，关闭fd并不会让它们结束
+void UringEpoller::QueueCancel_(uint64_t target) {
+    io_uring_sqe* sqe = GetSqe_();
+    if(!sqe) { return; }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->flags = controlFlags_;
+    sqe->user_data = CONTROL_TAG;
+    __atomic_store_n(sqKTail_, ++sqTail_, __ATOMIC_RELEASE);
+    pending_++;
+}
+
+void UringEpoller::QueueProvide_(unsigned bid, unsigned count) {
+    io_uring_sqe* sqe = GetSqe_();
+    if(!sqe) { return; }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(recvBufs_.get() + static_cast<size_t>(bid) * RECV_BUF_SIZE);
+    sqe->len = RECV_BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = BUF_GROUP;
+    sqe->flags = controlFlags_;
+    sqe->user_data = CONTROL_TAG;
+    __atomic_store_n(sqKTail_, ++sqTail_, __ATOMIC_RELEASE);
+    pending_++;
+}
+
+/// 发送完成（或者取消）后才能释放数据，SendOp留着下次用
+void UringEpoller::ReleaseSend_(SendOp* op) {
+    op->copied.clear();
+    op->owners.clear();
+    freeSends_.emplace_back(op);
+}
+
+/// 非事件循环线程的修改立即提交；先放开mtx_再进内核，SENDMSG可能就在这次调用里完成并唤醒事件循环
+void UringEpoller::FlushIfForeign_(unique_lock<mutex>& locker) {
+    if(pending_ == 0 || this_thread::get_id() == loopThread_) { return; }
+    unsigned toSubmit = pending_;
+    pending_ = 0;
+    locker.unlock();
+    int ret = Submit_(toSubmit, 0, 0, nullptr, 0);
+    unsigned submitted = ret > 0 ? static_cast<unsigned>(ret) : 0;
+    if(submitted < toSubmit) {
+        locker.lock();
+        pending_ += toSubmit - submitted;
+    }
+}
+
+bool UringEpoller::AddFd(int fd, uint32_t events) {
+    if(fd < 0) return false;
+    unique_lock<mutex> locker(mtx_);
+    if(static_cast<size_t>(fd) >= regs_.size()) { regs_.resize(fd + 1); }
+    Registration& reg = regs_[fd];
+    if(reg.active) { return false; }
+    reg.active = true;
+    reg.events = events;
+    reg.gen++;
+    /// 完成模式的连接只注册，不关注就绪事件，由Recv/Send驱动
+    if(events & (EPOLLIN | EPOLLOUT)) { QueuePoll_(fd, reg); }
+    FlushIfForeign_(locker);
+    return true;
+}
+
+bool UringEpoller::ModFd(int fd, uint32_t events) {
+    if(fd < 0) return false;
+    unique_lock<mutex> locker(mtx_);
+    if(static_cast<size_t>(fd) >= regs_.size() || !regs_[fd].active) { return false; }
+    Registration& reg = regs_[fd];
+    if(reg.armed) { QueueRemove_(fd, reg); }
+    reg.events = events;
+    reg.gen++;
+    QueuePoll_(fd, reg);
+    FlushIfForeign_(locker);
+    return true;
+}
+
+bool UringEpoller::DelFd(int fd) {
+    if(fd < 0) return false;
+    unique_lock<mutex> locker(mtx_);
+    if(static_cast<size_t>(fd) >= regs_.size() || !regs_[fd].active) { return false; }
+    Registration& reg = regs_[fd];
+    if(reg.armed) { QueueRemove_(fd, reg); }
+    if(reg.receiving) { QueueCancel_(UserData_(KIND_RECV, fd, reg.gen)); }
+    /// 在途的发送由它的完成事件释放
+    if(reg.sending) { QueueCancel_((static_cast<uint64_t>(KIND_SEND) << 62) | reinterpret_cast<uint64_t>(reg.sending)); }
+    reg.receiving = false;
+    reg.sending = nullptr;
+    reg.active = false;
+    reg.gen++;
+    FlushIfForeign_(locker);
+    return true;
+}
+
+bool UringEpoller::Recv(int fd) {
+    if(fd < 0) return false;
+    unique_lock<mutex> locker(mtx_);
+    if(static_cast<size_t>(fd) >= regs_.size() || !regs_[fd].active) { return false; }
+    Registration& reg = regs_[fd];
+    if(reg.receiving) { return true; }
+    if(!recvBufs_) {
+        recvBufs_.reset(new char[static_cast<size_t>(RECV_BUFS) * RECV_BUF_SIZE]);
+        QueueProvide_(0, RECV_BUFS);
+    }
+    io_uring_sqe* sqe = GetSqe_();
+    if(!sqe) { return false; }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = RECV_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = UserData_(KIND_RECV, fd, reg.gen);
+    __atomic_store_n(sqKTail_, ++sqTail_, __ATOMIC_RELEASE);
+    pending_++;
+    reg.receiving = true;
+    FlushIfForeign_(locker);
+    return true;
+}
+
+bool UringEpoller::Send(int fd, const struct iovec* iov, const shared_ptr<const void>* owners, int cnt, bool more) {
+    if(fd < 0 || cnt <= 0) return false;
+    unique_lock<mutex> locker(mtx_);
+    if(static_cast<size_t>(fd) >= regs_.size() || !regs_[fd].active || regs_[fd].sending) { return false; }
+    Registration& reg = regs_[fd];
+    io_uring_sqe* sqe = GetSqe_();
+    if(!sqe) { return false; }
+    SendOp* op;
+    if(freeSends_.empty()) {
+        op = new SendOp();
+    } else {
+        op = freeSends_.back().release();
+        freeSends_.pop_back();
+    }
+    op->fd = fd;
+    /* 先算出要复制的总长度，一次分配好，iov再指向复制后的位置 */
+    size_t copyLen = 0;
+    for(int i = 0; i < cnt; i++) {
+        if(!owners[i]) { copyLen += iov[i].iov_len; }
+    }
+    op->copied.resize(copyLen);
+    op->iov.assign(iov, iov + cnt);
+    op->owners.clear();
+    size_t pos = 0;
+    for(int i = 0; i < cnt; i++) {
+        if(owners[i]) {
+            op->owners.push_back(owners[i]);
+            continue;
+        }
+        memcpy(op->copied.data() + pos, iov[i].iov_base, iov[i].iov_len);
+        op->iov[i].iov_base = op->copied.data() + pos;
+        pos += iov[i].iov_len;
+    }
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov.data();
+    op->msg.msg_iovlen = op->iov.size();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&op->msg);
+    sqe->len = 1;
+    sqe->msg_flags = more ? MSG_MORE | MSG_NOSIGNAL : MSG_NOSIGNAL;
+    sqe->user_data = (static_cast<uint64_t>(KIND_SEND) << 62) | reinterpret_cast<uint64_t>(op);
+    __atomic_store_n(sqKTail_, ++sqTail_, __ATOMIC_RELEASE);
+    pending_++;
+    reg.sending = op;
+    FlushIfForeign_(locker);
+    return true;
+}
+
+bool UringEpoller::GetCompletion(size_t i, int* bytes) const {
+    assert(i < completions_.size());
+    *bytes = completions_[i].bytes;
+    return completions_[i].done;
+}
+
+const char* UringEpoller::GetRecvData(size_t i) const {
+    assert(i < completions_.size());
+    return completions_[i].data;
+}
+
+/// 一次io_uring_enter同时完成：提交积攒的POLL_ADD/POLL_REMOVE/RECV/SENDMSG + 等待完成事件
+int UringEpoller::Wait(int timeoutMs) {
+    unsigned toSubmit;
+    {
+        lock_guard<mutex> locker(mtx_);
+        loopThread_ = this_thread::get_id();
+        /// 上一批事件的接收数据已经被调用者取走，缓冲区交还内核
+        for(uint16_t bid: lent_) { QueueProvide_(bid, 1); }
+        lent_.clear();
+        toSubmit = pending_;
+        pending_ = 0;
+    }
+
+    struct __kernel_timespec ts = { 0, 0 };
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if(timeoutMs > 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+    unsigned minComplete = (timeoutMs == 0) ? 0 : 1;
+    bool ready = __atomic_load_n(cqKTail_, __ATOMIC_ACQUIRE) != *cqKHead_;
+    if(toSubmit > 0 || (!ready && minComplete > 0)) {
+        unsigned flags = IORING_ENTER_EXT_ARG;
+        if(!ready && minComplete > 0) { flags |= IORING_ENTER_GETEVENTS; }
+        int ret = Submit_(toSubmit, minComplete, flags, &arg, sizeof(arg));
+        unsigned submitted = ret > 0 ? static_cast<unsigned>(ret) : 0;
+        if(submitted < toSubmit) {
+            lock_guard<mutex> locker(mtx_);
+            pending_ += toSubmit - submitted;
+        }
+        if(ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+            errno = -ret;
+            return -1;
+        }
+    }
+
+    /* 收割完成事件，转换成epoll_event放入events_ */
+    lock_guard<mutex> locker(mtx_);
+    int n = 0;
+    unsigned head = *cqKHead_;
+    unsigned tail = __atomic_load_n(cqKTail_, __ATOMIC_ACQUIRE);
+    while(head != tail && static_cast<size_t>(n) < events_.size()) {
+        const io_uring_cqe& cqe = cqes_[head & *cqKMask_];
+        head++;
+        Kind kind = static_cast<Kind>(cqe.user_data >> 62);
+        if(kind == KIND_CONTROL) { continue; }
+        if(kind == KIND_SEND) {
+            SendOp* op = reinterpret_cast<SendOp*>(cqe.user_data & ~CONTROL_TAG);
+            int fd = op->fd;
+            bool valid = regs_[fd].active && regs_[fd].sending == op;     /// 删除fd时sending已经清空
+            ReleaseSend_(op);
+            if(!valid || cqe.res == -ECANCELED) { continue; }
+            regs_[fd].sending = nullptr;
+            events_[n].data.fd = fd;
+            events_[n].events = EPOLLOUT;
+            completions_[n] = { true, cqe.res, nullptr };
+            n++;
+            continue;
+        }
+        int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+        uint32_t gen = static_cast<uint32_t>((cqe.user_data >> 32) & GEN_MASK);
+        bool hasBuf = kind == KIND_RECV && (cqe.flags & IORING_CQE_F_BUFFER);
+        uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if(static_cast<size_t>(fd) >= regs_.size() || !regs_[fd].active || (regs_[fd].gen & GEN_MASK) != gen) {
+            if(hasBuf) { QueueProvide_(bid, 1); }
+            continue;   /// fd已经删除或重新注册，旧事件丢弃
+        }
+        Registration& reg = regs_[fd];
+        if(kind == KIND_RECV) {
+            reg.receiving = false;
+            if(cqe.res == -ENOBUFS || cqe.res == -EAGAIN) {
+                /// 接收缓冲区都借出去了（或者内核不替非阻塞socket等待），这一次改成就绪通知，由调用者自己读
+                reg.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                QueuePoll_(fd, reg);
+                continue;
+            }
+            if(cqe.res == -ECANCELED) {
+                if(hasBuf) { QueueProvide_(bid, 1); }
+                continue;
+            }
+            events_[n].data.fd = fd;
+            events_[n].events = EPOLLIN;
+            completions_[n] = { true, cqe.res, nullptr };
+            if(hasBuf) {
+                if(cqe.res > 0) { completions_[n].data = recvBufs_.get() + static_cast<size_t>(bid) * RECV_BUF_SIZE; }
+                lent_.push_back(bid);
+            }
+            n++;
+            continue;
+        }
+        reg.armed = false;
+        if(cqe.res == -ECANCELED) { continue; }
+        events_[n].data.fd = fd;
+        events_[n].events = cqe.res < 0 ? EPOLLERR : static_cast<uint32_t>(cqe.res);
+        completions_[n] = { false, 0, nullptr };
+        n++;
+        /// 没有EPOLLONESHOT的fd（监听socket、eventfd、子Reactor的连接）需要重新挂上，下一次Wait时一起提交
+        if(!(reg.events & EPOLLONESHOT)) { QueuePoll_(fd, reg); }
+    }
+    __atomic_store_n(cqKHead_, head, __ATOMIC_RELEASE);
+    return n;
+}
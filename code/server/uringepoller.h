@@ -0,0 +1,138 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-19
+ * @copyleft Apache 2.0
+ */
+#ifndef URING_EPOLLER_H
+#define URING_EPOLLER_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>  // syscall()
+#include <sys/mman.h>     // mmap()
+#include <sys/socket.h>   // msghdr, MSG_MORE
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+
+#include "epoller.h"
+#include "../log/log.h"
+
+/// io_uring后端：接口与Epoller一致，用IORING_OP_POLL_ADD代替epoll_ctl + epoll_wait
+/// 完成模式下连接的收发也交给内核：Recv提交IORING_OP_RECV，从共享的接收缓冲区组里取缓冲区（IORING_OP_PROVIDE_BUFFERS），
+/// 空闲连接不占接收缓冲区；Send提交IORING_OP_SENDMSG，响应头复制一份，文件只持有引用，连接在发送途中关闭也不会发出已释放的内存
+/// 接收缓冲区用完或者内核返回EAGAIN时，这一次退回就绪通知（POLL_ADD），由调用者自己读
+/// 事件循环线程里的注册/修改/删除/收发只写入SQ，和下一次Wait合并成一次io_uring_enter提交；
+/// 其它线程（线程池）调用时立即提交，避免事件循环阻塞在等待中时重新注册的事件迟迟不生效
+class UringEpoller : public Epoller {
+public:
+    explicit UringEpoller(int maxEvent = 1024);
+
+    ~UringEpoller() override;
+
+    /// 内核是否支持本后端需要的io_uring特性
+    static bool IsSupported();
+
+    bool AddFd(int fd, uint32_t events) override;
+
+    bool ModFd(int fd, uint32_t events) override;
+
+    bool DelFd(int fd) override;
+
+    int Wait(int timeoutMs = -1) override;
+
+    bool CanComplete() const override { return true; }
+
+    bool Recv(int fd) override;
+
+    bool Send(int fd, const struct iovec* iov, const std::shared_ptr<const void>* owners, int cnt, bool more) override;
+
+    bool GetCompletion(size_t i, int* bytes) const override;
+
+    const char* GetRecvData(size_t i) const override;
+
+    /// 共享接收缓冲区的个数和大小：同时在收数据的连接最多这么多个，一次最多收这么多字节
+    static const unsigned RECV_BUFS = 256;
+    static const unsigned RECV_BUF_SIZE = 16 << 10;
+
+private:
+    /// 一次在途的发送：内核发完之前，数据都由它持有
+    struct SendOp {
+        int fd;
+        struct msghdr msg;
+        std::vector<struct iovec> iov;
+        std::vector<char> copied;                           /// 复制过来的响应头
+        std::vector<std::shared_ptr<const void>> owners;    /// 文件的引用
+    };
+
+    /// 每个fd的注册信息，gen用来丢弃fd被删除或重用后才到达的旧完成事件
+    struct Registration {
+        uint32_t events = 0;
+        uint32_t gen = 0;
+        bool active = false;
+        bool armed = false;
+        bool receiving = false;         /// 有在途的RECV
+        SendOp* sending = nullptr;      /// 在途的SENDMSG
+    };
+
+    /// 每个事件的完成结果，和events_一一对应
+    struct Completion {
+        bool done;
+        int bytes;
+        const char* data;
+    };
+
+    /// user_data的最高两位区分请求的种类；POLL和RECV的低62位是(gen, fd)，SEND的是SendOp的地址
+    enum Kind : uint64_t { KIND_POLL = 0, KIND_RECV = 1, KIND_SEND = 2, KIND_CONTROL = 3 };
+    static const uint64_t GEN_MASK = 0x3fffffff;
+    static const uint64_t CONTROL_TAG = static_cast<uint64_t>(KIND_CONTROL) << 62;
+    static const uint16_t BUF_GROUP = 0;
+
+    static uint64_t UserData_(Kind kind, int fd, uint32_t gen) {
+        return (static_cast<uint64_t>(kind) << 62) | ((gen & GEN_MASK) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    io_uring_sqe* GetSqe_();
+    void QueuePoll_(int fd, Registration& reg);
+    void QueueRemove_(int fd, Registration& reg);
+    void QueueCancel_(uint64_t target);
+    /// 把接收缓冲区[bid, bid + count)交还给内核
+    void QueueProvide_(unsigned bid, unsigned count);
+    void ReleaseSend_(SendOp* op);
+    void FlushIfForeign_(std::unique_lock<std::mutex>& locker);
+    int Submit_(unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize);
+
+    int ringFd_;
+    unsigned sqEntries_;
+    uint8_t controlFlags_;        /// 内核支持时为IOSQE_CQE_SKIP_SUCCESS
+    unsigned sqTail_;             /// 本地维护的SQ尾，填好SQE后发布到*sqKTail_
+    unsigned pending_;            /// 已经放进SQ但还没有提交给内核的SQE数量
+
+    void* sqRing_;
+    size_t sqRingSize_;
+    void* cqRing_;
+    size_t cqRingSize_;
+    io_uring_sqe* sqes_;
+    size_t sqesSize_;
+
+    unsigned* sqKHead_;
+    unsigned* sqKTail_;
+    unsigned* sqKMask_;
+    unsigned* sqKArray_;
+    unsigned* cqKHead_;
+    unsigned* cqKTail_;
+    unsigned* cqKMask_;
+    io_uring_cqe* cqes_;
+
+    std::mutex mtx_;
+    std::thread::id loopThread_;
+    std::vector<Registration> regs_;
+    std::vector<Completion> completions_;
+
+    std::unique_ptr<char[]> recvBufs_;          /// 第一次Recv时分配并交给内核
+    std::vector<uint16_t> lent_;                /// 上一次Wait交给调用者的接收缓冲区，下一次Wait时交还内核
+    std::vector<std::unique_ptr<SendOp>> freeSends_;
+};
+
+#endif //URING_EPOLLER_H
@@ -14,9 +14,17 @@ WebServer::WebServer(
             int port, int trigMode, int timeoutMS, bool OptLinger,
             int sqlPort, const char* sqlUser, const  char* sqlPwd,
             const char* dbName, int connPoolNum, int threadNum,
-            bool openLog, int logLevel, int logQueSize):
-            port_(port), openLinger_(OptLinger), timeoutMS_(timeoutMS), isClose_(false),
-            timer_(new HeapTimer()), threadpool_(new ThreadPool(threadNum)), epoller_(new Epoller())
+            bool openLog, int logLevel, int logQueSize, const ServerConfig& config):
+            port_(port), openLinger_(OptLinger), reusePort_(config.reusePort),
+            listenBacklog_(config.listenBacklog), timeoutMS_(timeoutMS), isClose_(false),
+            timer_(new TimingWheel()), threadpool_(new ThreadPool(threadNum, config.workerAffinity, config.pinWorkers)), epoller_(Epoller::Create(config.useIoUring)),
+            diskpool_(config.diskThreadNum > 0 ? new ThreadPool(config.diskThreadNum) : nullptr),
+            dbpool_(config.dbThreadNum > 0 ? new ThreadPool(config.dbThreadNum) : nullptr),
+            bulkpool_(config.bulkThreadNum > 0 ?
+                      new ThreadPool(config.bulkThreadNum, config.workerAffinity, config.pinWorkers) : nullptr),
+            bulkBytes_(config.bulkBytes), poolStatsMS_(config.poolStatsMS), taskDeadlineMS_(config.taskDeadlineMS),
+            users_(MAX_FD),
+            nextReactor_(0)
     {
     srcDir_ = getcwd(nullptr, 256);   //getcwd()会将当前工作目录的绝对路径复制到参数buffer所指的内存空间中,参数maxlen为buffer的空间大小
     assert(srcDir_);                  //如果绝对路径获取失败就退出
@@ -29,8 +37,31 @@ WebServer::WebServer(
     std::cout<<sqlPort<<" "<<sqlUser<<" "<<sqlPwd<<" "<<dbName<<" "<<connPoolNum<<endl;
     SqlConnPool::Instance()->Init("localhost", sqlPort, sqlUser, sqlPwd, dbName, connPoolNum);
 
+    /// 静态文件映射缓存，单例模式
+    FileCache::Instance()->Init(config.fileCacheBytes, config.fileCacheCheckMS, config.sendfileThreshold);
+    HttpConn::useSendfile = config.useSendfile;
+    HttpResponse::smallFileBytes = config.smallFileBytes;
+    HttpConn::checkResident = static_cast<bool>(diskpool_);
+
+    /// 弹性扩容，数据库卡住或者缺页时临时加线程
+    if(config.poolTargetWaitMS > 0 && config.poolIdleMS > 0) {
+        threadpool_->SetElastic(config.maxThreadNum, config.poolTargetWaitMS, config.poolIdleMS);
+        if(dbpool_) { dbpool_->SetElastic(config.maxDbThreadNum, config.poolTargetWaitMS, config.poolIdleMS); }
+    }
+
     //设置服务器工作模式
     InitEventMode_(trigMode);
+    wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(wakeupFd_ >= 0);
+    epoller_->AddFd(wakeupFd_, EPOLLIN);
+    /// 多Reactor模式下主循环只accept，子Reactor在本线程里读写，仍然用就绪通知
+    completion_ = config.subReactorNum == 0 && epoller_->CanComplete();
+
+    /// 多Reactor模式，每个子Reactor一个线程，有自己的epoll和定时器
+    for(int i = 0; i < config.subReactorNum; i++) {
+        subReactors_.emplace_back(new SubReactor(i, timeoutMS_, connEvent_, config.useIoUring, diskpool_.get(),
+                                                 dbpool_.get(), taskDeadlineMS_));
+    }
 
     //设置服务器侦听socket，并将侦听socket上epoll树
     if(!InitSocket_()) { isClose_ = true;}
@@ -49,6 +80,28 @@ WebServer::WebServer(
             LOG_INFO("LogSys level: %d", logLevel);
             LOG_INFO("srcDir: %s", HttpConn::srcDir);
             LOG_INFO("SqlConnPool num: %d, ThreadPool num: %d", connPoolNum, threadNum);
+            LOG_INFO("SubReactor num: %d", config.subReactorNum);
+            LOG_INFO("ReusePort: %s, Listen backlog: %d", reusePort_? "true":"false", listenBacklog_);
+            LOG_INFO("IO backend: %s", completion_? "io_uring completion" : (config.useIoUring? "io_uring":"epoll"));
+            LOG_INFO("FileCache: %zu bytes, check %d ms, sendfile threshold: %zu, %s", config.fileCacheBytes,
+                            config.fileCacheCheckMS, config.sendfileThreshold,
+                            config.useSendfile? "sendfile":"mmap window");
+            LOG_INFO("Small file response cache: %zu bytes", config.smallFileBytes);
+            LOG_INFO("Disk IO threads: %d", config.diskThreadNum);
+            LOG_INFO("DB threads: %d, Bulk threads: %d (>= %zu bytes)", config.dbThreadNum,
+                            config.bulkThreadNum, bulkBytes_);
+            LOG_INFO("Worker affinity: %s, pin CPU: %s", config.workerAffinity? "true":"false",
+                            config.pinWorkers? "true":"false");
+            LOG_INFO("Task deadline: %d ms", taskDeadlineMS_);
+            LOG_INFO("Elastic threads: max %d, DB max %d, target wait %d ms, idle %d ms", config.maxThreadNum,
+                            config.maxDbThreadNum, config.poolTargetWaitMS, config.poolIdleMS);
+        }
+        /// 统计借用定时器输出，只有开启超时时主循环才会驱动定时器
+        if(!isClose_ && timeoutMS_ > 0 && poolStatsMS_ > 0) {
+            for(ThreadPool* pool: { threadpool_.get(), dbpool_.get(), bulkpool_.get(), diskpool_.get() }) {
+                if(pool) { pool->EnableStats(); }
+            }
+            timer_->add(&statsNode_, poolStatsMS_, [this]() { LogPoolStats_(); });
         }
     }
 }
@@ -56,8 +109,13 @@ WebServer::WebServer(
 
 ///析构函数
 WebServer::~WebServer() {
+    ///先停掉所有子Reactor线程
+    for(auto& reactor: subReactors_) {
+        reactor->Stop();
+    }
     ///关闭socket侦听描述符
-    close(listenFd_);
+    if(listenFd_ >= 0) { close(listenFd_); }
+    close(wakeupFd_);
     isClose_ = true;
     ///释放记录资源目录路径的字符串
     free(srcDir_);
@@ -94,6 +152,9 @@ void WebServer::InitEventMode_(int trigMode) {
 void WebServer::Start() {
     int timeMS = -1;  /* epoll wait timeout == -1 无事件将阻塞 */
     if(!isClose_) { LOG_INFO("========== Server start =========="); }
+    for(auto& reactor: subReactors_) {
+        reactor->Start();
+    }
     ///服务器主循环函数
     while(!isClose_) {
         /// 如果设置了超时事件，就扫描堆上下一个定时器还有多少时间到期，
@@ -111,9 +172,19 @@ void WebServer::Start() {
             uint32_t events = epoller_->GetEvents(i);
 
             /// 如果是服务端侦听描述符有事件发生，就处理侦听事件描述符
+            int bytes = 0;
             if(fd == listenFd_) {
                 DealListen_();
             }
+            /// 磁盘IO线程预读完成
+            else if(fd == wakeupFd_) {
+                HandleWakeup_();
+            }
+            /// io_uring完成事件：数据已经收到或者已经发出
+            else if(epoller_->GetCompletion(i, &bytes)) {
+                assert(users_.Get(fd));
+                DealComplete_(users_.Get(fd), events, bytes, epoller_->GetRecvData(i));
+            }
             /// https://blog.csdn.net/q576709166/article/details/8649911?spm=1001.2101.3001.6661.1&utm_medium=distribute.pc_relevant_t0.none-task-blog-2%7Edefault%7ECTRLIST%7Edefault-1-8649911-blog-105234862.pc_relevant_default&depth_1-utm_source=distribute.pc_relevant_t0.none-task-blog-2%7Edefault%7ECTRLIST%7Edefault-1-8649911-blog-105234862.pc_relevant_default&utm_relevant_index=1
             /// 1）客户端直接调用close，会触犯EPOLLRDHUP事件
             /// 2）通过EPOLLRDHUP属性，来判断是否对端已经关闭，这样可以减少一次系统调用。在2.6.17的内核版本之前，只能再通过调用一次recv函数来判断
@@ -132,18 +203,18 @@ void WebServer::Start() {
             /// 这个时候，如果对方异常关闭了，则会出现EPOLLERR，出现Error把对方DEL掉，close就可以
             /// 了。
             else if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                assert(users_.count(fd) > 0);
-                CloseConn_(&users_[fd]);  //关闭用户连接
+                assert(users_.Get(fd));
+                CloseConn_(users_.Get(fd));  //关闭用户连接
             }
             /// fd读事件发生了  有新连接请求，对端发送普通数据 触发EPOLLIN。
             else if(events & EPOLLIN) {
-                assert(users_.count(fd) > 0);
-                DealRead_(&users_[fd]);  //处理读数据
+                assert(users_.Get(fd));
+                DealRead_(users_.Get(fd));  //处理读数据
             }
             /// fd写事件发生了  EPOLLOUT 有数据要写
             else if(events & EPOLLOUT) {
-                assert(users_.count(fd) > 0);
-                DealWrite_(&users_[fd]); //处理写数据
+                assert(users_.Get(fd));
+                DealWrite_(users_.Get(fd)); //处理写数据
             } else { /// 如果是其他类型的事件，则打印错误并忽略
                 LOG_ERROR("Unexpected event");
             }
@@ -168,27 +239,34 @@ void WebServer::CloseConn_(HttpConn* client) {
     LOG_INFO("Client[%d] quit!", client->GetFd());
     /// 从epoll树上摘下文件描述符
     epoller_->DelFd(client->GetFd());
+    /// 槽位代数加一，还在线程池队列里的任务和定时器回调都会失效
+    users_.Release(client->GetFd());
     /// 关闭客户端的连接，并释放资源
     client->Close();
 }
 
 void WebServer::AddClient_(int fd, sockaddr_in addr) {
     assert(fd > 0);
-    users_[fd].init(fd, addr);  /// 初始化用户连接的数组
-    if(timeoutMS_ > 0) { /// 如果设置了超时时间，就注册到定时器，并绑定定时器到期事件的回调函数 bind是一个适配器 和下面的lamda表达式一致
-        //        timer_->add(fd, timeoutMS_, [&](){
-        //            assert(&users_[fd]);
-        //            LOG_INFO("Client[%d] quit!", (&users_[fd])->GetFd());
-        //            epoller_->DelFd((&users_[fd])->GetFd());
-        //            (&users_[fd])->Close();
-        //        });
-        timer_->add(fd, timeoutMS_, std::bind(&WebServer::CloseConn_, this, &users_[fd]));
-    }
-    /// 上epoll树，并监听读事件
-    epoller_->AddFd(fd, EPOLLIN | connEvent_);
+    uint32_t gen = 0;
+    HttpConn* client = users_.Acquire(fd, &gen);
+    client->init(fd, addr);  /// 初始化用户连接的槽位
+    if(timeoutMS_ > 0) { /// 如果设置了超时时间，就注册到定时器，并绑定定时器到期事件的回调函数
+        /// 回调只记下(fd, gen)，到期时连接已经关闭或fd被新连接复用就什么也不做
+        timer_->add(users_.TimerNode(fd), timeoutMS_, [this, fd, gen]() {
+            HttpConn* client = users_.Get(fd, gen);
+            if(client) { CloseConn_(client); }
+        });
+    }
     /// 设置文件描述符为非阻塞
     SetFdNonblock(fd);
-    LOG_INFO("Client[%d] in!", users_[fd].GetFd());
+    /// 上epoll树，并监听读事件；完成模式下只注册，直接提交接收
+    if(completion_) {
+        epoller_->AddFd(fd, connEvent_);
+        epoller_->Recv(fd);
+    } else {
+        epoller_->AddFd(fd, EPOLLIN | connEvent_);
+    }
+    LOG_INFO("Client[%d] in!", client->GetFd());
 }
 
 /// 处理监听描述符事件
@@ -199,11 +277,18 @@ void WebServer::DealListen_() {
         /// 返回连接的文件描述符
         int fd = accept(listenFd_, (struct sockaddr *)&addr, &len);
         if(fd <= 0) { return;}  /// 如果返回的文件描述符为负数，则客户端与服务端的连接出错，直接返回
-        else if(HttpConn::userCount >= MAX_FD) {  /// 如果用户连接的的数量已经大于最大的MAX_FD(65536)，则直接返回
+        /// 如果用户连接的的数量已经大于最大的MAX_FD(65536)，则直接返回；
+        /// RLIMIT_NOFILE可以大于MAX_FD，fd本身超出连接槽位数组的也拒绝
+        else if(HttpConn::userCount >= MAX_FD || fd >= MAX_FD) {
             SendError_(fd, "Server busy!");
             LOG_WARN("Clients is full!");
             return;
         }
+        if(!subReactors_.empty()) {  /// 多Reactor模式，轮询交给子Reactor，由子Reactor上epoll树
+            SetFdNonblock(fd);
+            subReactors_[nextReactor_++ % subReactors_.size()]->QueueConn(fd, addr);
+            continue;
+        }
         AddClient_(fd, addr);     /// 将用户连接文件描述符上epoll树
     } while(listenEvent_ & EPOLLET);   /// 直到事件处理完为止
 }
@@ -211,24 +296,38 @@ void WebServer::DealListen_() {
 /// 处理客户端发过来的请求
 void WebServer::DealRead_(HttpConn* client) {
     assert(client);
-    ExtentTime_(client);  /// 先调整定时器事件堆结构
-
-    /// 线程池添加任务，OnRead_()是绑定回调函数，可转化为lamda形式
-    threadpool_->AddTask(std::bind(&WebServer::OnRead_, this, client));
+    ExtentTime_(client);  /// 先刷新定时器的到期时间
+
+    /// 线程池添加任务，任务里只记下(fd, gen)，执行时连接已经失效就丢弃
+    int fd = client->GetFd();
+    uint32_t gen = users_.Generation(fd);
+    /// 按fd选工作线程，同一个连接的事件总先交给同一个线程；排队超过taskDeadlineMS_就不再处理
+    threadpool_->AddTask(fd, taskDeadlineMS_, [this, fd, gen]() {
+        HttpConn* client = users_.Get(fd, gen);
+        if(client) { OnRead_(client); }
+    }, [this, fd, gen]() { DropExpired_(fd, gen); });
 }
 
 void WebServer::DealWrite_(HttpConn* client) {
     assert(client);
-    ExtentTime_(client);  /// 先调整定时器事件堆结构
-
-    /// 线程池添加任务，bind是绑定任务处理回调函数，可转化为lamda形式
-    threadpool_->AddTask(std::bind(&WebServer::OnWrite_, this, client));
+    ExtentTime_(client);  /// 先刷新定时器的到期时间
+
+    /// 线程池添加任务，任务里只记下(fd, gen)，执行时连接已经失效就丢弃
+    int fd = client->GetFd();
+    uint32_t gen = users_.Generation(fd);
+    /// 大传输放进自己的线程池，不占处理静态请求的线程
+    ThreadPool* pool = bulkpool_ && client->ToWriteBytes() >= bulkBytes_ ?
+                       bulkpool_.get() : threadpool_.get();
+    pool->AddTask(fd, [this, fd, gen]() {
+        HttpConn* client = users_.Get(fd, gen);
+        if(client) { OnWrite_(client); }
+    });
 }
 
-/// 调整文件描述符定时器事件的到期信息，将到期的截止时间重新初始化为timeoutMS_  这里是60s,并调整堆结构
+/// 调整文件描述符定时器事件的到期信息，将到期的截止时间重新初始化为timeoutMS_  这里是60s，时间轮上O(1)挪到新的槽
 void WebServer::ExtentTime_(HttpConn* client) {
     assert(client);
-    if(timeoutMS_ > 0) { timer_->adjust(client->GetFd(), timeoutMS_); }
+    if(timeoutMS_ > 0) { timer_->adjust(users_.TimerNode(client->GetFd()), timeoutMS_); }
 }
 
 /// 服务端读客户端请求回调处理函数，线程池如果有空闲资源会调用此函数
@@ -249,13 +348,105 @@ void WebServer::OnRead_(HttpConn* client) {
 
 /// 客户端数据处理类
 void WebServer::OnProcess(HttpConn* client) {
-    if(client->process()) {
-        epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
+    if(client->process(static_cast<bool>(dbpool_))) {
+        Rearm_(client, EPOLLOUT);
+    } else if(client->WaitingVerify()) {
+        /// 登录/注册要查数据库，交给数据库线程，查完在那里继续处理；EPOLLONESHOT下这期间连接不会有事件
+        int fd = client->GetFd();
+        uint32_t gen = users_.Generation(fd);
+        dbpool_->AddTask(fd, taskDeadlineMS_, [this, fd, gen]() {
+            HttpConn* client = users_.Get(fd, gen);
+            if(client && client->WaitingVerify()) {
+                Rearm_(client, client->process() ? EPOLLOUT : EPOLLIN);
+            }
+        }, [this, fd, gen]() { DropExpired_(fd, gen); });
     } else {
+        Rearm_(client, EPOLLIN);
+    }
+}
+
+void WebServer::Rearm_(HttpConn* client, uint32_t event) {
+    if(!completion_) {
+        epoller_->ModFd(client->GetFd(), connEvent_ | event);
+    } else if(event == EPOLLOUT) {
+        StartSend_(client);
+    } else if(!epoller_->Recv(client->GetFd())) {
         epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLIN);
     }
 }
 
+void WebServer::StartSend_(HttpConn* client) {
+    const struct iovec* iov = nullptr;
+    std::shared_ptr<const void> owners[HttpConn::MAX_IOV];
+    bool more = false;
+    int cnt = client->FillSend(&iov, owners, &more);
+    if(cnt > 0 && epoller_->Send(client->GetFd(), iov, owners, cnt, more)) { return; }
+    if(client->IsCold()) {
+        Prefetch_(client);
+        return;
+    }
+    epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
+}
+
+/// 同一个连接同时只有一个在途的接收或发送，这期间没有别的线程处理这个连接，可以直接在这里记账
+void WebServer::DealComplete_(HttpConn* client, uint32_t events, int bytes, const char* data) {
+    assert(client);
+    if(bytes <= 0) {    /// 对端关闭，或者收发出错
+        CloseConn_(client);
+        return;
+    }
+    ExtentTime_(client);
+    if(events & EPOLLIN) {
+        client->Received(data, bytes);
+        DealProcess_(client);
+        return;
+    }
+    client->Sent(bytes);
+    if(client->ToWriteBytes() > 0) {
+        StartSend_(client);
+    } else if(!client->IsKeepAlive()) {
+        CloseConn_(client);
+    } else if(client->HasBufferedInput()) {
+        DealProcess_(client);     /// 流水线里剩下的请求
+    } else {
+        Rearm_(client, EPOLLIN);
+    }
+}
+
+void WebServer::DealProcess_(HttpConn* client) {
+    assert(client);
+    int fd = client->GetFd();
+    uint32_t gen = users_.Generation(fd);
+    threadpool_->AddTask(fd, taskDeadlineMS_, [this, fd, gen]() {
+        HttpConn* client = users_.Get(fd, gen);
+        if(client) { OnProcess(client); }
+    }, [this, fd, gen]() { DropExpired_(fd, gen); });
+}
+
+/// 请求在队列里等得太久，客户端多半已经放弃了，关闭连接，不再花时间处理
+void WebServer::DropExpired_(int fd, uint32_t gen) {
+    HttpConn* client = users_.Get(fd, gen);
+    if(!client) { return; }
+    LOG_WARN("Client[%d] request waited over %d ms, dropped", fd, taskDeadlineMS_);
+    CloseConn_(client);
+}
+
+void WebServer::LogPoolStats_() {
+    const std::pair<const char*, ThreadPool*> pools[] = {
+        { "static", threadpool_.get() }, { "db", dbpool_.get() },
+        { "bulk", bulkpool_.get() }, { "disk", diskpool_.get() },
+    };
+    for(const auto& pool: pools) {
+        if(!pool.second) { continue; }
+        ThreadPool::Stats stats = pool.second->TakeStats();
+        if(stats.tasks == 0 && stats.depth == 0 && stats.grown == stats.shrunk) { continue; }
+        LOG_INFO("ThreadPool %s: depth %zu, %zu tasks, %zu expired, wait avg %lld us, max %lld us, "
+                 "%zu threads (grown %zu, shrunk %zu)", pool.first, stats.depth, stats.tasks, stats.expired,
+                 (long long)stats.avgWaitUs, (long long)stats.maxWaitUs, stats.threads, stats.grown, stats.shrunk);
+    }
+    timer_->adjust(&statsNode_, poolStatsMS_);
+}
+
 
 /// 服务端写返回客户端响应的回调处理函数
 void WebServer::OnWrite_(HttpConn* client) {
@@ -265,6 +456,10 @@ void WebServer::OnWrite_(HttpConn* client) {
 
     ret = client->write(&writeErrno);
 
+    if(client->IsCold()) {
+        Prefetch_(client);
+        return;
+    }
     if(client->ToWriteBytes() == 0) {
         /* 传输完成 */
         if(client->IsKeepAlive()) {
@@ -272,26 +467,86 @@ void WebServer::OnWrite_(HttpConn* client) {
             return;
         }
     }
-    else if(ret < 0) {
-        if(writeErrno == EAGAIN) {
-            /* 继续传输 */
-            epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
-            return;
-        }
+    else if(ret > 0 || writeErrno == EAGAIN) {
+        /* 继续传输，LT模式下write()写一次就返回，也可能还有剩余 */
+        Rearm_(client, EPOLLOUT);
+        return;
     }
     CloseConn_(client);
 }
 
+/// EPOLLONESHOT下预读期间连接不会有事件，也没有在途的收发
+void WebServer::Prefetch_(HttpConn* client) {
+    int fd = client->GetFd();
+    uint32_t gen = users_.Generation(fd);
+    diskpool_->AddTask([this, fd, gen, prefetch = client->TakePrefetch()]() {
+        prefetch();
+        {
+            lock_guard<mutex> locker(wakeupMtx_);
+            prefetched_.emplace_back(fd, gen);
+        }
+        uint64_t one = 1;
+        if(::write(wakeupFd_, &one, sizeof(one)) != sizeof(one)) {
+            LOG_WARN("Prefetch wakeup error!");
+        }
+    });
+}
+
+/// 连接的关闭和新连接的accept也在这个线程（或者在持有这个连接的工作线程，而预读中的连接没有工作线程持有），
+/// 这里代数对得上，就一定还是发起预读的那个连接
+void WebServer::HandleWakeup_() {
+    uint64_t cnt = 0;
+    ssize_t n = ::read(wakeupFd_, &cnt, sizeof(cnt));
+    (void)n;
+    vector<pair<int, uint32_t>> conns;
+    {
+        lock_guard<mutex> locker(wakeupMtx_);
+        conns.swap(prefetched_);
+    }
+    for(auto& item: conns) {
+        HttpConn* client = users_.Get(item.first, item.second);
+        if(client) { Rearm_(client, EPOLLOUT); }
+    }
+}
+
 
 ///初始化服务端监听socket
 /* Create listenFd */
 bool WebServer::InitSocket_() {
-    int ret;
-    struct sockaddr_in addr;
     if(port_ > 65535 || port_ < 1024) {
         LOG_ERROR("Port:%d error!",  port_);
         return false;
     }
+
+    /// SO_REUSEPORT多监听模式：每个子Reactor绑定自己的监听socket，由内核把新连接分散到各个线程上
+    if(reusePort_ && !subReactors_.empty()) {
+        listenFd_ = -1;
+        for(auto& reactor: subReactors_) {
+            int fd = CreateListenFd_();
+            if(fd < 0) { return false; }
+            reactor->SetListenFd(fd, listenEvent_);
+        }
+        LOG_INFO("Server port:%d, %d reuseport listeners", port_, (int)subReactors_.size());
+        return true;
+    }
+
+    listenFd_ = CreateListenFd_();
+    if(listenFd_ < 0) { return false; }
+    //上epoll树
+    int ret = epoller_->AddFd(listenFd_,  listenEvent_ | EPOLLIN);
+    if(ret == 0) {
+        LOG_ERROR("Add listen error!");
+        close(listenFd_);
+        return false;
+    }
+    LOG_INFO("Server port:%d", port_);
+    return true;
+}
+
+/// 创建、绑定并监听一个socket，失败返回-1
+int WebServer::CreateListenFd_() {
+    int ret;
+    struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     addr.sin_port = htons(port_);
@@ -302,52 +557,54 @@ bool WebServer::InitSocket_() {
         optLinger.l_linger = 1;
     }
 
-    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if(listenFd_ < 0) {
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listenFd < 0) {
         LOG_ERROR("Create socket error!", port_);
-        return false;
+        return -1;
     }
 
-    ret = setsockopt(listenFd_, SOL_SOCKET, SO_LINGER, &optLinger, sizeof(optLinger));
+    ret = setsockopt(listenFd, SOL_SOCKET, SO_LINGER, &optLinger, sizeof(optLinger));
     if(ret < 0) {
-        close(listenFd_);
+        close(listenFd);
         LOG_ERROR("Init linger error!", port_);
-        return false;
+        return -1;
     }
 
     int optval = 1;
     /* 端口复用 */
     /* 只有最后一个套接字会正常接收数据。 */
-    ret = setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int));
+    ret = setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int));
     if(ret == -1) {
         LOG_ERROR("set socket setsockopt error !");
-        close(listenFd_);
-        return false;
+        close(listenFd);
+        return -1;
+    }
+
+    /* 多个socket（线程或进程）绑定同一端口，内核按四元组哈希分发新连接 */
+    if(reusePort_) {
+        ret = setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, (const void*)&optval, sizeof(int));
+        if(ret == -1) {
+            LOG_ERROR("set SO_REUSEPORT error !");
+            close(listenFd);
+            return -1;
+        }
     }
 
-    ret = bind(listenFd_, (struct sockaddr *)&addr, sizeof(addr));
+    ret = bind(listenFd, (struct sockaddr *)&addr, sizeof(addr));
     if(ret < 0) {
         LOG_ERROR("Bind Port:%d error!", port_);
-        close(listenFd_);
-        return false;
+        close(listenFd);
+        return -1;
     }
 
-    ret = listen(listenFd_, 6);
+    ret = listen(listenFd, listenBacklog_);
     if(ret < 0) {
         LOG_ERROR("Listen port:%d error!", port_);
-        close(listenFd_);
-        return false;
-    }
-    //上epoll树
-    ret = epoller_->AddFd(listenFd_,  listenEvent_ | EPOLLIN);
-    if(ret == 0) {
-        LOG_ERROR("Add listen error!");
-        close(listenFd_);
-        return false;
+        close(listenFd);
+        return -1;
     }
-    SetFdNonblock(listenFd_);
-    LOG_INFO("Server port:%d", port_);
-    return true;
+    SetFdNonblock(listenFd);
+    return listenFd;
 }
 
 /// 设置文件描述符为非阻塞
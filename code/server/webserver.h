@@ -7,17 +7,22 @@
 #define WEBSERVER_H
 
 #include <unordered_map>
+#include <mutex>
 #include <fcntl.h>       // fcntl()
 #include <unistd.h>      // close()
 #include <assert.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h> // eventfd()
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "epoller.h"
+#include "subreactor.h"
+#include "connslab.h"
+#include "../config/config.h"
 #include "../log/log.h"
-#include "../timer/heaptimer.h"
+#include "../timer/timingwheel.h"
 #include "../pool/sqlconnpool.h"
 #include "../pool/threadpool.h"
 #include "../pool/sqlconnRAII.h"
@@ -29,13 +34,15 @@ public:
         int port, int trigMode, int timeoutMS, bool OptLinger, 
         int sqlPort, const char* sqlUser, const  char* sqlPwd, 
         const char* dbName, int connPoolNum, int threadNum,
-        bool openLog, int logLevel, int logQueSize);
+        bool openLog, int logLevel, int logQueSize,
+        const ServerConfig& config = ServerConfig());
 
     ~WebServer();
     void Start();
 
 private:
     bool InitSocket_(); 
+    int CreateListenFd_();
     void InitEventMode_(int trigMode);
     void AddClient_(int fd, sockaddr_in addr);
   
@@ -51,25 +58,64 @@ private:
     void OnWrite_(HttpConn* client);
     void OnProcess(HttpConn* client);
 
+    /// 连接接下来要读（EPOLLIN）或者写（EPOLLOUT）：就绪模式下重新关注事件，完成模式下直接提交接收/发送
+    void Rearm_(HttpConn* client, uint32_t event);
+    /// 完成模式：把发送队列交给io_uring；sendfile/映射窗口的响应退回就绪通知，由OnWrite_用write()发送
+    void StartSend_(HttpConn* client);
+    /// 完成模式：在事件循环线程里处理一次接收/发送的完成
+    void DealComplete_(HttpConn* client, uint32_t events, int bytes, const char* data);
+    /// 完成模式：数据已经收进读缓冲区，线程池里直接处理
+    void DealProcess_(HttpConn* client);
+    /// 文件内容不在页缓存里，交给磁盘IO线程预读，读完通过wakeupFd_交回事件循环继续写
+    void Prefetch_(HttpConn* client);
+    /// 事件循环线程：取出预读完成的连接，代数还对得上才继续写
+    void HandleWakeup_();
+    /// 把各线程池的队列深度和等待时间写进日志，然后重新定时
+    void LogPoolStats_();
+    /// 排队过期的读/数据库任务的处理：连接还是原来那个就关闭
+    void DropExpired_(int fd, uint32_t gen);
+
     static const int MAX_FD = 65536;
 
     static int SetFdNonblock(int fd);
 
     int port_;
     bool openLinger_;
+    bool reusePort_;               /// 是否开启SO_REUSEPORT
+    int listenBacklog_;            /// listen()的全连接队列长度
     int timeoutMS_;  /* 毫秒MS */   /// 服务端超时事件，单位毫秒ms，这个初始化为600000ms = 60s
     bool isClose_;                 /// 服务器运行状态标志
     int listenFd_;                 /// 监听socket文件描述符
+    int wakeupFd_;                 /// eventfd，磁盘IO线程预读完成后写入唤醒事件循环
     char* srcDir_;                 /// 资源目录
     
     uint32_t listenEvent_;
     uint32_t connEvent_;
+    bool completion_;              /// io_uring完成模式：单Reactor下连接的收发由内核完成
    
     ///全部封装为unique_ptr，为了保证使用C++的RAII特性
-    std::unique_ptr<HeapTimer> timer_;          /// 定时器事件处理类
+    std::unique_ptr<TimingWheel> timer_;        /// 定时器事件处理类，时间轮，结点放在连接槽位里
     std::unique_ptr<ThreadPool> threadpool_;    /// 线程池类
     std::unique_ptr<Epoller> epoller_;          /// epoll处理类
-    std::unordered_map<int, HttpConn> users_;   /// 用户连接数组利用了哈希map，查找更高效
+    std::unique_ptr<ThreadPool> diskpool_;      /// 磁盘IO线程池，只做冷文件的预读，没有时为nullptr
+    /// 按工作的性质分开排队：threadpool_只处理便宜的静态请求，查数据库和大传输各有自己的线程，
+    /// 登录高峰或者大文件下载不会让静态请求排在后面；没有时为nullptr，这类工作留在threadpool_
+    std::unique_ptr<ThreadPool> dbpool_;        /// 登录/注册的MySQL查询
+    std::unique_ptr<ThreadPool> bulkpool_;      /// 剩余待发送不小于bulkBytes_的写
+    size_t bulkBytes_;
+    int poolStatsMS_;
+    int taskDeadlineMS_;                        /// 读和数据库任务排队的截止时间，0表示不过期
+    WheelNode statsNode_;
+    ConnSlab users_;                            /// 用户连接槽位数组，按fd直接下标寻址
+
+    /// 预读完成、等事件循环继续写的连接(fd, gen)；磁盘IO线程不碰epoll，检查代数和重新关注都在事件循环里做，
+    /// 否则检查之后、ModFd之前fd可能已经被关闭并分给了新连接
+    std::mutex wakeupMtx_;
+    std::vector<std::pair<int, uint32_t>> prefetched_;
+
+    /// 多Reactor模式：主线程只accept，连接按轮询分发给子Reactor
+    std::vector<std::unique_ptr<SubReactor>> subReactors_;
+    size_t nextReactor_;
 };
 
 
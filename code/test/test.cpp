@@ -5,6 +5,18 @@
  */ 
 #include "../code/log/log.h"
 #include "../code/pool/threadpool.h"
+#include "../code/timer/timingwheel.h"
+#include "../code/http/httprequest.h"
+#include "../code/http/httpscan.h"
+#include "../code/http/filecache.h"
+#include "../code/http/httpresponse.h"
+#include "../code/buffer/buffer.h"
+#include "../code/http/httpconn.h"
+#include <sys/socket.h>
+#include <set>
+#include <type_traits>
+#include <cstring>
+#include <zlib.h>
 #include <features.h>
 
 #if __GLIBC__ == 2 && __GLIBC_MINOR__ < 30
@@ -12,6 +24,25 @@
 #define gettid() syscall(SYS_gettid)
 #endif
 
+/// 统计整个进程的operator new次数，用来检查不该分配内存的路径
+/// 不内联，否则编译器在调用处看到new出来的指针交给free会报-Wmismatched-new-delete
+static std::atomic<size_t> allocCount(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if(!p) { throw std::bad_alloc(); }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
 void TestLog() {
     int cnt = 0, level = 0;
     Log::Instance()->init(level, "./testlog1", ".log", 0);
@@ -50,7 +81,880 @@ void TestThreadPool() {
     getchar();
 }
 
-int main() {
+/// 原来的线程池：一把锁一个条件变量保护一个任务队列，每个任务都notify_one，用来和ThreadPool比较
+class MutexThreadPool {
+public:
+    explicit MutexThreadPool(size_t threadCount): pool_(std::make_shared<Pool>()) {
+        for(size_t i = 0; i < threadCount; i++) {
+            std::thread([pool = pool_] {
+                std::unique_lock<std::mutex> locker(pool->mtx);
+                while(true) {
+                    if(!pool->tasks.empty()) {
+                        auto task = std::move(pool->tasks.front());
+                        pool->tasks.pop();
+                        locker.unlock();
+                        task();
+                        locker.lock();
+                    }
+                    else if(pool->isClosed) break;
+                    else pool->cond.wait(locker);
+                }
+            }).detach();
+        }
+    }
+
+    ~MutexThreadPool() {
+        {
+            std::lock_guard<std::mutex> locker(pool_->mtx);
+            pool_->isClosed = true;
+        }
+        pool_->cond.notify_all();
+    }
+
+    template<class F>
+    void AddTask(F&& task) {
+        {
+            std::lock_guard<std::mutex> locker(pool_->mtx);
+            pool_->tasks.emplace(std::forward<F>(task));
+        }
+        pool_->cond.notify_one();
+    }
+
+private:
+    struct Pool {
+        std::mutex mtx;
+        std::condition_variable cond;
+        bool isClosed = false;
+        std::queue<std::function<void()>> tasks;
+    };
+    std::shared_ptr<Pool> pool_;
+};
+
+/// producers个线程一共加tasks个很短的任务，返回从开始加到全部执行完的平均每个任务的纳秒数
+template<class Pool>
+double ThreadPoolNs(size_t threads, int producers, int tasks) {
+    Pool pool(threads);
+    std::atomic<int> done(0);
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> adders;
+    for(int p = 0; p < producers; p++) {
+        adders.emplace_back([&pool, &done, n = tasks / producers] {
+            for(int i = 0; i < n; i++) {
+                pool.AddTask([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+    }
+    for(std::thread& adder: adders) { adder.join(); }
+    while(done.load() < tasks / producers * producers) { std::this_thread::yield(); }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() / tasks;
+}
+
+void TestThreadPoolContention() {
+    /// 任务全部执行，工作线程里加的任务也执行，超过队列容量的任务进溢出队列
+    {
+        ThreadPool pool(4);
+        std::atomic<int> done(0);
+        const int n = 4 * ThreadPool::QUEUE_SIZE + 100;
+        for(int i = 0; i < n; i++) {
+            pool.AddTask([&pool, &done] {
+                pool.AddTask([&done] { done.fetch_add(1); });
+                done.fetch_add(1);
+            });
+        }
+        while(done.load() < 2 * n) { std::this_thread::yield(); }
+        assert(done.load() == 2 * n);
+    }
+    /// 析构后线程把已经加入的任务做完再退出
+    auto done = std::make_shared<std::atomic<int>>(0);
+    {
+        ThreadPool pool(2);
+        for(int i = 0; i < 1000; i++) {
+            pool.AddTask([done] { done->fetch_add(1); });
+        }
+    }
+    while(done->load() < 1000) { std::this_thread::yield(); }
+
+    /// 统计队列深度和等待时间，取出后清零
+    {
+        ThreadPool pool(1);
+        pool.EnableStats();
+        std::atomic<bool> go(false);
+        std::atomic<int> ran(0);
+        pool.AddTask([&go] { while(!go) { std::this_thread::yield(); } });
+        for(int i = 0; i < 10; i++) { pool.AddTask([&ran] { ran++; }); }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ThreadPool::Stats stats = pool.TakeStats();
+        assert(stats.depth == 10 && stats.tasks == 1);
+        go = true;
+        while(ran.load() < 10) { std::this_thread::yield(); }
+        stats = pool.TakeStats();
+        assert(stats.depth == 0 && stats.tasks == 10 && stats.maxWaitUs >= 20000);
+        stats = pool.TakeStats();
+        assert(stats.tasks == 0 && stats.maxWaitUs == 0);
+    }
+}
+
+/// 和原来的线程池比较吞吐，每种线程数取3次里最快的一次，6是main.cpp里工作线程的数量；只在 ./test bench 时运行
+void BenchThreadPool() {
+    const int tasks = 200000, producers = 2;
+    for(size_t threads: { 1, 2, 4, 6, 8, 16, 32, 64 }) {
+        double oldNs = 1e18, newNs = 1e18;
+        for(int round = 0; round < 3; round++) {
+            oldNs = std::min(oldNs, ThreadPoolNs<MutexThreadPool>(threads, producers, tasks));
+            newNs = std::min(newNs, ThreadPoolNs<ThreadPool>(threads, producers, tasks));
+        }
+        printf("ThreadPool %2zu threads: mutex %.1f ns/task, work-stealing %.1f ns/task\n",
+               threads, oldNs, newNs);
+    }
+}
+
+void TestThreadPoolAffinity() {
+    /// 亲和模式下同一个key的任务总在同一个线程执行，不同key分到不同线程
+    {
+        const int threads = 4, keys = 16, rounds = 200;
+        ThreadPool pool(threads, true);
+        std::mutex mtx;
+        std::vector<std::set<std::thread::id>> seen(keys);
+        std::atomic<int> done(0);
+        for(int r = 0; r < rounds; r++) {
+            for(int key = 0; key < keys; key++) {
+                pool.AddTask(key, [&, key] {
+                    std::lock_guard<std::mutex> locker(mtx);
+                    seen[key].insert(std::this_thread::get_id());
+                    done++;
+                });
+            }
+        }
+        while(done.load() < rounds * keys) { std::this_thread::yield(); }
+        std::set<std::thread::id> all;
+        for(int key = 0; key < keys; key++) {
+            assert(seen[key].size() == 1);
+            all.insert(*seen[key].begin());
+        }
+        assert(all.size() == threads);
+    }
+    /// 绑定CPU后每个工作线程只在一个CPU上运行
+    ThreadPool pool(2, true, true);
+    std::atomic<int> pinned(0), done(0);
+    for(int key = 0; key < 2; key++) {
+        pool.AddTask(key, [&] {
+            cpu_set_t set;
+            if(pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1) { pinned++; }
+            done++;
+        });
+    }
+    while(done.load() < 2) { std::this_thread::yield(); }
+    assert(pinned.load() == 2);
+}
+
+void TestThreadPoolElastic() {
+    /// 2个常驻线程都阻塞时，后来的任务等待超过5ms就加线程，最多到6个
+    ThreadPool pool(2);
+    pool.SetElastic(6, 5, 200);
+    std::atomic<int> done(0);
+    auto begin = std::chrono::steady_clock::now();
+    for(int i = 0; i < 8; i++) {
+        pool.AddTask([&done] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            done++;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    while(done.load() < 8) { std::this_thread::yield(); }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+    ThreadPool::Stats stats = pool.TakeStats();
+    printf("ThreadPool elastic: 8 blocking tasks in %lld ms, grew %zu threads\n", (long long)ms, stats.grown);
+    assert(stats.grown > 0 && stats.threads <= 6 && ms < 400);
+
+    /// 空闲200ms后临时线程全部退出
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    stats = pool.TakeStats();
+    assert(stats.threads == 2 && stats.shrunk == stats.grown);
+}
+
+void TestThreadPoolDeadline() {
+    /// 唯一的工作线程被占住，排在后面的任务超过截止时间，执行过期处理而不是任务本身
+    ThreadPool pool(1);
+    pool.EnableStats();
+    std::atomic<bool> go(false);
+    std::atomic<int> ran(0), expired(0), done(0);
+    pool.AddTask([&go] { while(!go) { std::this_thread::yield(); } });
+    pool.AddTask(0, 10, [&] { ran++; done++; }, [&] { expired++; done++; });
+    pool.AddTask(0, 10000, [&] { ran++; done++; }, [&] { expired++; done++; });
+    pool.AddTask(0, 0, [&] { ran++; done++; }, [&] { expired++; done++; });     /// 不过期
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    go = true;
+    while(done.load() < 3) { std::this_thread::yield(); }
+    assert(ran.load() == 2 && expired.load() == 1);
+    ThreadPool::Stats stats = pool.TakeStats();
+    assert(stats.expired == 1 && stats.tasks == 4);
+}
+
+void TestTask() {
+    /// 小的可调用对象放在Task内部，移动后原对象为空
+    int hit = 0;
+    Task task([&hit] { hit++; });
+    assert(task.IsInline());
+    Task moved(std::move(task));
+    assert(!task && moved);
+    moved();
+    assert(hit == 1);
+
+    /// 只能移动的捕获也可以；大的可调用对象放在堆上，照样能移动和执行
+    auto owned = std::make_unique<int>(7);
+    Task unique([p = std::move(owned), &hit] { hit += *p; });
+    char big[Task::INLINE_SIZE + 1] = { 1 };
+    Task heap([big, &hit] { hit += big[0]; });
+    assert(unique.IsInline() && !heap.IsInline());
+    unique = std::move(heap);
+    unique();
+    assert(hit == 2);
+    unique = nullptr;
+    assert(!unique);
+
+    /// 连接事件的分发（this + fd + generation）从AddTask到执行完都不分配内存
+    ThreadPool pool(2);
+    std::atomic<int> done(0);
+    struct Server { std::atomic<int>* done; } server = { &done };
+    Server* self = &server;
+    const int n = 10000;
+    for(int i = 0; i < 100; i++) {     /// 预热：线程启动、thread_local初始化
+        pool.AddTask([self] { self->done->fetch_add(1); });
+    }
+    while(done.load() < 100) { std::this_thread::yield(); }
+    size_t before = allocCount.load();
+    for(int i = 0; i < n; i++) {
+        /// 不让任务积压到超过队列容量，溢出队列不在这条路径上
+        while(100 + i - done.load() >= static_cast<int>(ThreadPool::QUEUE_SIZE)) { std::this_thread::yield(); }
+        int fd = i;
+        uint32_t gen = i;
+        pool.AddTask([self, fd, gen]() {
+            if(fd >= 0 && gen < UINT32_MAX) { self->done->fetch_add(1); }
+        });
+    }
+    while(done.load() < 100 + n) { std::this_thread::yield(); }
+    size_t allocs = allocCount.load() - before;
+    printf("Task dispatch: %d events, %zu allocations\n", n, allocs);
+    assert(allocs == 0);
+}
+
+void TestTimingWheel() {
+    TimingWheel timer;
+    WheelNode nodes[4];
+    std::vector<int> order;
+    timer.add(&nodes[0], 30, [&] { order.push_back(0); });
+    timer.add(&nodes[1], 10, [&] { order.push_back(1); });
+    timer.add(&nodes[2], 20, [&] { order.push_back(2); });
+    timer.add(&nodes[3], 5, [&] { order.push_back(3); });
+    timer.adjust(&nodes[1], 100);   /// 刷新后排到最后
+    timer.del(&nodes[2]);           /// 删除后不再触发
+    assert(timer.size() == 3);
+    int ms;
+    while((ms = timer.GetNextTick()) >= 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
+    assert(order.size() == 3 && order[0] == 3 && order[1] == 0 && order[2] == 1);
+    assert(timer.size() == 0 && timer.GetNextTick() == -1);
+}
+
+void TestHttpRequest() {
+    HttpRequest request;
+    Buffer buff;
+    /// 请求分两次到达，第一次只有半个请求头
+    buff.Append("GET /index?id=1 HTTP/1.1\r\nHost: localhost\r\nConnec");
+    assert(request.parse(buff) == HttpRequest::NO_REQUEST);
+    buff.Append("tion:  Keep-Alive \r\n\r\nGET /login HTTP/1.1\r\n\r\n");
+    assert(request.parse(buff) == HttpRequest::GET_REQUEST);
+    assert(request.method() == "GET" && request.version() == "1.1");
+    assert(request.path() == "/index.html");
+    assert(request.GetHeader("host") == "localhost");
+    assert(request.IsKeepAlive());
+    request.Consume(buff);
+    /// 同一个缓冲区里的下一个请求
+    assert(request.parse(buff) == HttpRequest::GET_REQUEST);
+    assert(request.path() == "/login.html" && !request.IsKeepAlive());
+    assert(!request.NeedsVerify());
+    request.Consume(buff);
+    assert(buff.ReadableBytes() == 0);
+
+    /// 登录请求解析时不查数据库，只记下要校验
+    buff.Append("POST /login HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                "Content-Length: 21\r\n\r\nusername=a&password=b");
+    assert(request.parse(buff) == HttpRequest::GET_REQUEST);
+    assert(request.NeedsVerify() && request.path() == "/login.html" && request.GetPost("username") == "a");
+    request.Consume(buff);
+    assert(buff.ReadableBytes() == 0);
+
+    /// 表单在GetPost时才解码：'+'是空格，同一个key后面的覆盖前面的
+    buff.Append("POST /x HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                "Content-Length: 18\r\n\r\na=1&a=2&b=x+y&c=&d");
+    assert(request.parse(buff) == HttpRequest::GET_REQUEST && !request.NeedsVerify());
+    assert(request.GetPost("a") == "2" && request.GetPost("b") == "x y" && request.GetPost("c") == "");
+    assert(request.GetPost("d") == "" && request.GetPost("e") == "");
+    request.Consume(buff);
+
+    /// 解析和改写path都不分配内存
+    buff.Append("GET /register?x=1 HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    size_t before = allocCount.load();
+    assert(request.parse(buff) == HttpRequest::GET_REQUEST);
+    assert(request.path() == "/register.html");
+    assert(allocCount.load() == before);
+    request.Consume(buff);
+    assert(buff.ReadableBytes() == 0);
+
+    buff.Append("BAD\r\n\r\n");
+    assert(request.parse(buff) == HttpRequest::BAD_REQUEST);
+    request.Consume(buff);
+    assert(buff.ReadableBytes() == 0);
+}
+
+/// 各级实现和逐字节实现的结果必须一致，然后对比解析一个约1KB请求头（带cookie）的耗时
+void TestHttpScan() {
+    const HttpScan::Level origin = HttpScan::Current();
+    std::string data;
+    srand(1);
+    for(int i = 0; i < 4096; i++) {
+        const char pool[] = "aZ09-_~:; \t\r\n\x80/=";
+        data.push_back(pool[rand() % (sizeof(pool) - 1)]);
+    }
+    const char* begin = data.data();
+    const char* end = begin + data.size();
+    const char crlf[] = "\r\n";
+    for(size_t off = 0; off < 256; off++) {
+        const char* found = std::search(begin + off, end, crlf, crlf + 2);
+        assert(HttpScan::FindCRLF(begin + off, end) == (found == end ? nullptr : found));
+    }
+    for(int level = HttpScan::SCALAR; level <= HttpScan::Supported(); level++) {
+        for(size_t off = 0; off < 256; off++) {
+            HttpScan::SetLevel(HttpScan::SCALAR);
+            const char* token = HttpScan::ScanToken(begin + off, end);
+            HttpScan::SetLevel(static_cast<HttpScan::Level>(level));
+            assert(HttpScan::ScanToken(begin + off, end) == token);
+        }
+    }
+
+    /// 单独测token扫描：请求头名一般不到20字节，SIMD的优势在长token上
+    for(size_t len: { 8, 16, 32, 64, 256 }) {
+        std::string token(len, 't');
+        token += ':';
+        const int calls = 2000000;
+        for(int level = HttpScan::SCALAR; level <= HttpScan::Supported(); level++) {
+            HttpScan::SetLevel(static_cast<HttpScan::Level>(level));
+            const char* stop = nullptr;
+            auto start = std::chrono::steady_clock::now();
+            for(int i = 0; i < calls; i++) {
+                stop = HttpScan::ScanToken(token.data(), token.data() + token.size());
+                asm volatile("" : : "r"(stop) : "memory");
+            }
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            assert(*stop == ':');
+            printf("HttpScan level %d: %3zu bytes token, %.1f ns/scan\n", level, len, ns / calls);
+        }
+    }
+
+    std::string request = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/84.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\nAccept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+        "Cookie: ";
+    for(int i = 0; i < 12; i++) {
+        request += "session_" + std::to_string(i) + "=0123456789abcdef0123456789abcdef0123456789; ";
+    }
+    request += "\r\nConnection: keep-alive\r\n\r\n";
+    /// 请求头多、名字长的请求（网关/代理加的头），token扫描占的比例大
+    std::string proxied = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n";
+    for(int i = 0; i < 24; i++) {
+        proxied += "X-Forwarded-Internal-Trace-Context-" + std::to_string(i) + ": 1\r\n";
+    }
+    proxied += "Connection: keep-alive\r\n\r\n";
+    const int rounds = 200000;
+    for(const std::string& head: { request, proxied }) {
+        for(int level = HttpScan::SCALAR; level <= HttpScan::Supported(); level++) {
+            HttpScan::SetLevel(static_cast<HttpScan::Level>(level));
+            HttpRequest req;
+            Buffer buff;
+            auto start = std::chrono::steady_clock::now();
+            for(int i = 0; i < rounds; i++) {
+                buff.Append(head);
+                assert(req.parse(buff) == HttpRequest::GET_REQUEST);
+                req.Consume(buff);
+            }
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            printf("HttpScan level %d: %zu bytes head, %.1f ns/request\n", level, head.size(), ns / rounds);
+        }
+    }
+    HttpScan::SetLevel(origin);
+}
+
+void TestFileCache() {
+    FileCache* cache = FileCache::Instance();
+    cache->Init(64, 0);     /// 每次都重新校验，单个文件最大16字节
+    const std::string path = "./testfilecache.txt";
+    FILE* fp = fopen(path.data(), "w");
+    fputs("0123456789", fp);
+    fclose(fp);
+    FilePtr first = cache->Get(path);
+    assert(first && first->st.st_size == 10 && memcmp(first->data, "0123456789", 10) == 0);
+    assert(cache->Get(path) == first && cache->Size() == 1);   /// 没有变化，共享同一个映射
+
+    /// 部署时用rename替换文件（新inode），原地改写会直接反映到已有的映射里
+    fp = fopen((path + ".tmp").data(), "w");
+    fputs("abcdefghijkl", fp);
+    fclose(fp);
+    rename((path + ".tmp").data(), path.data());
+    FilePtr second = cache->Get(path);
+    assert(second != first && second->st.st_size == 12 && memcmp(second->data, "abcdefghijkl", 12) == 0);
+    assert(memcmp(first->data, "0123456789", 10) == 0);         /// 旧映射的持有者不受影响
+    assert(cache->Bytes() == 12);
+
+    unlink(path.data());
+    assert(!cache->Get(path) && cache->Size() == 0);
+    assert(!cache->Get("./"));
+    cache->Clear();
+}
+
+void TestContentEncoding() {
+    const int GZIP = 1 << FileCache::ENCODING_GZIP, BR = 1 << FileCache::ENCODING_BR;
+    assert(HttpResponse::ParseAcceptEncoding("gzip, deflate, br") == (GZIP | BR));
+    assert(HttpResponse::ParseAcceptEncoding("GZIP;q=0.5, br;q=0") == GZIP);
+    assert(HttpResponse::ParseAcceptEncoding("*") == (GZIP | BR));
+    assert(HttpResponse::ParseAcceptEncoding("identity") == 0);
+
+    FileCache* cache = FileCache::Instance();
+    cache->Init(1 << 20, 1000);
+    const std::string path = "./testencoding.css";
+    std::string text;
+    for(int i = 0; i < 200; i++) { text += ".item-" + std::to_string(i) + " { margin: 0 auto; }\n"; }
+    FILE* fp = fopen(path.data(), "w");
+    fputs(text.data(), fp);
+    fclose(fp);
+
+    /// 第一次请求交给后台压缩，先返回nullptr，之后返回内存里的gzip版本
+    FilePtr file = cache->Get(path);
+    assert(!cache->GetEncoded(path, file, FileCache::ENCODING_GZIP, true));
+    FilePtr gz;
+    for(int i = 0; i < 200 && !gz; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        gz = cache->GetEncoded(path, file, FileCache::ENCODING_GZIP, true);
+    }
+    assert(gz && static_cast<size_t>(gz->st.st_size) < text.size());
+    std::vector<char> plain(text.size());
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, 15 + 16);
+    zs.next_in = reinterpret_cast<Bytef*>(gz->data);
+    zs.avail_in = gz->st.st_size;
+    zs.next_out = reinterpret_cast<Bytef*>(plain.data());
+    zs.avail_out = plain.size();
+    assert(inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == text.size());
+    inflateEnd(&zs);
+    assert(memcmp(plain.data(), text.data(), text.size()) == 0);
+    unlink(path.data());
+    cache->Clear();
+}
+
+void TestConditional() {
+    FILE* fp = fopen("./testcond.html", "w");
+    fputs("<html></html>", fp);
+    fclose(fp);
+    std::string path = "testcond.html";
+    HttpResponse response;
+    Buffer buff;
+    response.Init("./", path, true, 200);
+    response.MakeResponse(buff);
+    std::string head = buff.RetrieveAllToStr();
+    size_t pos = head.find("ETag: ");
+    assert(head.find(" 200 ") != std::string::npos && pos != std::string::npos);
+    std::string etag = head.substr(pos + 6, head.find("\r\n", pos) - pos - 6);
+    assert(response.FileLen() == 13 && response.File());
+
+    response.Init("./", path, true, 200);
+    std::string weak = "W/" + etag;
+    response.SetConditional(false, weak, "");
+    response.MakeResponse(buff);
+    head = buff.RetrieveAllToStr();
+    assert(head.find(" 304 ") != std::string::npos && response.FileLen() == 0);
+
+    /// HEAD 带Content-length，不带body
+    response.Init("./", path, true, 200);
+    response.SetConditional(true, "", "");
+    response.MakeResponse(buff);
+    head = buff.RetrieveAllToStr();
+    assert(head.find("Content-length: 13\r\n\r\n") != std::string::npos && response.FileLen() == 0);
+
+    /// 范围请求只发送文件的一部分
+    response.Init("./", path, true, 200);
+    response.SetRange("bytes=1-4", "");
+    response.MakeResponse(buff);
+    head = buff.RetrieveAllToStr();
+    assert(head.find(" 206 ") != std::string::npos && head.find("Content-Range: bytes 1-4/13") != std::string::npos);
+    assert(response.Parts() == 1 && response.Part(0).first == 1 && response.Part(0).second == 4);
+    unlink("./testcond.html");
+    FileCache::Instance()->Clear();
+}
+
+void TestHeaderCache() {
+    FILE* fp = fopen("./testhead.html", "w");
+    fputs("<html></html>", fp);
+    fclose(fp);
+    std::string path = "testhead.html";
+    size_t small = HttpResponse::smallFileBytes;
+    HttpResponse::smallFileBytes = 0;   /// 只缓存响应头
+    HttpResponse response;
+    Buffer buff;
+    std::string heads[2];
+    for(int i = 0; i < 2; i++) {
+        response.Init("./", path, true, 200);
+        response.MakeResponse(buff);
+        heads[i] = buff.RetrieveAllToStr();
+        assert(response.FileLen() == 13 && response.Parts() == 1);
+    }
+    /// 第二次命中缓存，除了Date完全一样
+    size_t pos = heads[0].find("Date: ");
+    assert(pos != std::string::npos && heads[0].size() == heads[1].size());
+    assert(heads[0].substr(0, pos) == heads[1].substr(0, pos));
+    assert(heads[0].substr(pos + 35) == heads[1].substr(pos + 35));
+    assert(heads[0].find("Content-length: 13\r\n") != std::string::npos);
+
+    /// 文件变了，缓存的响应头作废
+    fp = fopen("./testhead.tmp", "w");
+    fputs("<html>changed</html>", fp);
+    fclose(fp);
+    rename("./testhead.tmp", "./testhead.html");
+    FileCache::Instance()->Clear();
+    response.Init("./", path, false, 200);
+    response.MakeResponse(buff);
+    response.Init("./", path, true, 200);
+    response.MakeResponse(buff);
+    std::string head = buff.RetrieveAllToStr();
+    assert(head.find("Connection: close") != std::string::npos);
+    assert(head.find("Content-length: 20\r\n") != std::string::npos && head.find("Content-length: 13") == std::string::npos);
+
+    /// 被忽略的Range请求先填了槽位，后面的普通请求照样带Vary
+    fp = fopen("./testhead.tmp", "w");
+    fputs("<html>ranged</html>", fp);
+    fclose(fp);
+    rename("./testhead.tmp", "./testhead.html");
+    FileCache::Instance()->Clear();
+    response.Init("./", path, true, 200);
+    response.SetRange("bytes=x", "");
+    response.MakeResponse(buff);
+    head = buff.RetrieveAllToStr();
+    assert(head.find(" 200 ") != std::string::npos && head.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+    response.Init("./", path, true, 200);
+    response.MakeResponse(buff);
+    head = buff.RetrieveAllToStr();
+    assert(head.find("Vary: Accept-Encoding\r\n") != std::string::npos);
+    unlink("./testhead.html");
+    FileCache::Instance()->Clear();
+    HttpResponse::smallFileBytes = small;
+}
+
+void TestSmallFile() {
+    FILE* fp = fopen("./testsmall.html", "w");
+    fputs("<html></html>", fp);
+    fclose(fp);
+    std::string path = "testsmall.html";
+    HttpResponse response;
+    Buffer buff;
+    response.Init("./", path, true, 200);
+    response.MakeResponse(buff);
+    std::string head = buff.RetrieveAllToStr();
+    /// 第二次整个响应来自缓存的一块内存，不再往写缓冲区写响应头
+    response.Init("./", path, true, 200);
+    response.MakeResponse(buff);
+    assert(buff.ReadableBytes() == 0 && response.Parts() == 1);
+    std::string whole(response.File(), response.FileLen());
+    assert(whole.size() == head.size() + 13 && whole.compare(0, 17, "HTTP/1.1 200 OK\r\n") == 0);
+    assert(whole.compare(whole.size() - 13, 13, "<html></html>") == 0);
+    /// HEAD只用缓存的响应头
+    response.Init("./", path, true, 200);
+    response.SetConditional(true, "", "");
+    response.MakeResponse(buff);
+    assert(buff.ReadableBytes() == head.size() && response.FileLen() == 0);
+    buff.RetrieveAll();
+
+    /// 解析失败的请求不按路径查文件，一定是400
+    response.Init("./", path, false, 400);
+    response.MakeResponse(buff);
+    head = buff.RetrieveAllToStr();
+    assert(head.compare(0, 13, "HTTP/1.1 400 ") == 0);
+
+    /// 错误页和小文件一样，第二次命中缓存的整块响应
+    mkdir("./testerr", 0755);
+    fp = fopen("./testerr/404.html", "w");
+    fputs("<html>404</html>", fp);
+    fclose(fp);
+    std::string missing = "/nope.html";
+    response.Init("./testerr", missing, true, 200);
+    response.MakeResponse(buff);
+    head = buff.RetrieveAllToStr();
+    assert(head.compare(0, 13, "HTTP/1.1 404 ") == 0 && head.find("Content-length: 16\r\n") != std::string::npos);
+    missing = "/nope.html";
+    response.Init("./testerr", missing, true, 200);
+    response.MakeResponse(buff);
+    assert(buff.ReadableBytes() == 0 && response.Parts() == 1);
+    whole.assign(response.File(), response.FileLen());
+    assert(whole.size() == head.size() + 16 && whole.compare(0, 13, "HTTP/1.1 404 ") == 0);
+    assert(whole.compare(whole.size() - 16, 16, "<html>404</html>") == 0);
+    unlink("./testerr/404.html");
+    rmdir("./testerr");
+    unlink("./testsmall.html");
+    FileCache::Instance()->Clear();
+}
+
+void TestResident() {
+    std::string content(1 << 20, 'r');
+    FILE* fp = fopen("./testcold.bin", "w");
+    fwrite(content.data(), 1, content.size(), fp);
+    fflush(fp);
+    fsync(fileno(fp));
+    /// 写回磁盘后从页缓存里丢掉，再预读回来
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+    fclose(fp);
+    FileCache::Instance()->Init(64 << 20, 1000, 1 << 30);     /// 映射
+    FilePtr mapped = FileCache::Instance()->Get("./testcold.bin");
+    assert(mapped && mapped->data);
+    LOG_DEBUG("mapped resident before prefetch: %d", FileCache::Resident(*mapped, 0, 256 << 10));
+    FileCache::Prefetch(*mapped, 0, 512 << 10);
+    assert(FileCache::Resident(*mapped, 0, 256 << 10) && FileCache::Resident(*mapped, 256 << 10, 256 << 10));
+
+    FileCache::Instance()->Clear();
+    FileCache::Instance()->Init(64 << 20, 1000, 4096);        /// 只保留fd
+    FilePtr direct = FileCache::Instance()->Get("./testcold.bin");
+    assert(direct && !direct->data && direct->fd >= 0);
+    FileCache::Prefetch(*direct, 512 << 10, 512 << 10);
+    assert(FileCache::Resident(*direct, 512 << 10, 512 << 10));
+
+    /// 内存里的内容总是在
+    MappedFile memory;
+    memory.memory.assign(16, 'm');
+    memory.data = memory.memory.data();
+    memory.st.st_size = 16;
+    assert(FileCache::Resident(memory, 0, 16));
+    unlink("./testcold.bin");
+    FileCache::Instance()->Clear();
+    FileCache::Instance()->Init(64 << 20, 1000);
+}
+
+void TestBuffer() {
+    Buffer buff(16);
+    assert(buff.Blocks() == 0 && buff.ReadableBytes() == 0);
+    /// 追加超过尾块的数据接新块，Peek()合并成连续的一块
+    std::string expect;
+    for(int i = 0; i < 500; i++) {
+        std::string line = "line " + std::to_string(i) + "\r\n";
+        buff.Append(line);
+        expect += line;
+    }
+    assert(buff.Blocks() > 1 && buff.ReadableBytes() == expect.size());
+    assert(std::string(buff.Peek(), buff.ReadableBytes()) == expect && buff.Blocks() == 1);
+    buff.Retrieve(7);
+    assert(std::string(buff.Peek(), buff.ReadableBytes()) == expect.substr(7));
+    /// 读完块就还回去
+    buff.Retrieve(buff.ReadableBytes());
+    assert(buff.Blocks() == 0);
+
+    /// ReadFd：尾块放不下的数据留在新块里，不经过中转
+    int fds[2];
+    int ret = pipe(fds);
+    assert(ret == 0);
+    std::string data(40000, 'x');
+    buff.Append("head", 4);
+    size_t writable = buff.WritableBytes();
+    ssize_t len = write(fds[1], data.data(), data.size());
+    assert(len == static_cast<ssize_t>(data.size()));
+    int err = 0;
+    len = buff.ReadFd(fds[0], &err);
+    assert(len == static_cast<ssize_t>(data.size()));
+    assert(buff.Blocks() == (writable < data.size() ? 2u : 1u));
+    assert(std::string(buff.Peek(), buff.ReadableBytes()) == "head" + data);
+    close(fds[0]);
+    close(fds[1]);
+    BufferPool* pool = BufferPool::Instance();
+    size_t free = pool->FreeBytes() + pool->LocalBytes();
+    buff.RetrieveAll();
+    assert(buff.Blocks() == 0 && pool->FreeBytes() + pool->LocalBytes() > free);
+
+    /// 块先还到本线程的缓存里，再取同样大小的块拿到的是刚还的那块
+    size_t cap = 0;
+    char* block = pool->Allocate(BufferPool::MIN_BLOCK, &cap);
+    pool->Free(block, cap);
+    size_t cap2 = 0;
+    char* again = pool->Allocate(BufferPool::MIN_BLOCK, &cap2);
+    assert(again == block && cap2 == cap);
+    pool->Free(block, cap);
+
+    /// 线程退出时本地缓存的块还给全局链表，别的线程可以取到
+    free = pool->FreeBytes();
+    std::thread([pool]() {
+        size_t cap = 0;
+        char* block = pool->Allocate(64 << 10, &cap);
+        pool->Free(block, cap);
+        assert(pool->LocalBytes() == cap);
+    }).join();
+    assert(pool->FreeBytes() > free);
+
+    /// 超过最大块的数据单独分配
+    std::string big(BufferPool::MAX_BLOCK + 10, 'b');
+    buff.Append(big);
+    assert(buff.ReadableBytes() == big.size() && std::string(buff.Peek(), buff.ReadableBytes()) == big);
+    buff.RetrieveAll();
+}
+
+/// 当前进程的常驻内存（字节）
+static size_t ResidentBytes() {
+    long pages = 0, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(!fp) { return 0; }
+    if(fscanf(fp, "%ld %ld", &pages, &resident) != 2) { resident = 0; }
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/// N个连接各处理完一个请求后进入空闲状态，返回每个空闲连接占用的常驻内存（字节）
+/// 所有连接共用一对socketpair，依次读请求、发响应，只为了走完真实的读写路径
+static double IdleBytesPerConn(int conns) {
+    FILE* fp = fopen("./testidle.html", "w");
+    assert(fp);
+    fputs("<html>idle</html>", fp);
+    fclose(fp);
+    int sv[2];
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(ret == 0);
+    HttpConn::srcDir = "./";
+    HttpConn::isET = false;
+    const char request[] = "GET /testidle.html HTTP/1.1\r\nHost: x\r\nConnection: keep-alive\r\n\r\n";
+    char scratch[4096];
+    sockaddr_in addr = { 0 };
+
+    size_t before = ResidentBytes();
+    std::vector<std::unique_ptr<HttpConn>> users(conns);
+    for(int i = 0; i < conns; i++) {
+        users[i].reset(new HttpConn());
+        HttpConn* conn = users[i].get();
+        conn->init(sv[0], addr);
+        int err = 0;
+        ssize_t len = write(sv[1], request, sizeof(request) - 1);
+        assert(len == sizeof(request) - 1);
+        len = conn->read(&err);
+        assert(len > 0);
+        bool ready = conn->process();
+        assert(ready);
+        len = conn->write(&err);
+        assert(len > 0 && conn->ToWriteBytes() == 0);
+        len = read(sv[1], scratch, sizeof(scratch));
+        assert(len > 0);
+    }
+    size_t after = ResidentBytes();
+    /// 先关掉socket，连接析构时的close只会返回EBADF
+    close(sv[0]);
+    close(sv[1]);
+    users.clear();
+    HttpConn::userCount = 0;
+    unlink("./testidle.html");
+    FileCache::Instance()->Clear();
+    return static_cast<double>(after - before) / conns;
+}
+
+/// 空闲连接的缓冲区块都还给了缓冲池，只剩连接对象本身；哪怕留着一个最小的块也会超出预算
+void TestIdleMemory() {
+    const int conns = 4000;
+    double perConn = IdleBytesPerConn(conns);
+    assert(perConn < sizeof(HttpConn) + BufferPool::MIN_BLOCK / 2);
+}
+
+/// 基准：10万个空闲连接各占多少常驻内存
+void BenchIdleMemory() {
+    const int conns = 100000;
+    printf("Idle connections: %d, %.1f bytes resident per connection (HttpConn object %zu bytes)\n",
+           conns, IdleBytesPerConn(conns), sizeof(HttpConn));
+}
+
+/// 大文件的响应：待发送字节数是size_t，超过2GB也不会截断成int（编译时检查，不用真的造一个几GB的文件）
+/// 不用sendfile时按映射窗口分段发出，跨过几个窗口的内容原样到达对端
+void TestHugeReply() {
+    static_assert(std::is_same<decltype(std::declval<HttpConn>().ToWriteBytes()), size_t>::value,
+                  "ToWriteBytes must not truncate replies larger than 2GB");
+    const size_t size = 2 * HttpConn::WINDOW_SIZE + 12345;
+    std::string content(size, 0);
+    for(size_t i = 0; i < size; i++) { content[i] = static_cast<char>('a' + i % 26); }
+    FILE* fp = fopen("./testhuge.bin", "w");
+    assert(fp);
+    size_t n = fwrite(content.data(), 1, size, fp);
+    fclose(fp);
+    assert(n == size);
+    int sv[2];
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(ret == 0);
+    HttpConn::srcDir = "./";
+    HttpConn::isET = false;
+    HttpConn::useSendfile = false;
+    const char request[] = "GET /testhuge.bin HTTP/1.1\r\nHost: x\r\nConnection: keep-alive\r\n\r\n";
+    sockaddr_in addr = { 0 };
+    {
+        HttpConn conn;
+        conn.init(sv[0], addr);
+        int err = 0;
+        ssize_t len = write(sv[1], request, sizeof(request) - 1);
+        assert(len == sizeof(request) - 1);
+        len = conn.read(&err);
+        assert(len > 0);
+        bool ready = conn.process();
+        assert(ready);
+        size_t toWrite = conn.ToWriteBytes();
+        assert(toWrite > size && toWrite < size + 4096);
+        /// socket缓冲区装不下整个响应，对端边收边比较
+        std::string received;
+        std::thread reader([&]() {
+            char buf[65536];
+            while(received.size() < toWrite) {
+                ssize_t got = read(sv[1], buf, sizeof(buf));
+                if(got <= 0) { break; }
+                received.append(buf, got);
+            }
+        });
+        while(conn.ToWriteBytes() > 0) {
+            len = conn.write(&err);
+            if(len <= 0) { break; }
+        }
+        reader.join();
+        assert(conn.ToWriteBytes() == 0 && received.size() == toWrite);
+        assert(received.compare(toWrite - size, size, content) == 0);
+        close(sv[0]);
+        close(sv[1]);
+    }
+    HttpConn::useSendfile = true;
+    HttpConn::userCount = 0;
+    unlink("./testhuge.bin");
+    FileCache::Instance()->Clear();
+}
+
+int main(int argc, char** argv) {
+    /// 性能比较不是正确性检查，单独运行：./test bench
+    if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+        BenchThreadPool();
+        BenchIdleMemory();
+        return 0;
+    }
+    TestTimingWheel();
+    TestHttpRequest();
+    TestHttpScan();
+    TestFileCache();
+    TestContentEncoding();
+    TestConditional();
+    TestHeaderCache();
+    TestSmallFile();
+    TestResident();
+    TestBuffer();
+    TestIdleMemory();
+    TestHugeReply();
+    TestThreadPoolContention();
+    TestThreadPoolAffinity();
+    TestThreadPoolElastic();
+    TestThreadPoolDeadline();
+    TestTask();
     TestLog();
     TestThreadPool();
 }
\ No newline at end of file
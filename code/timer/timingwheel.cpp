@@ -0,0 +1,149 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-17
+ * @copyleft Apache 2.0
+ */
+#include "timingwheel.h"
+
+/// 把64位图循环右移shift位
+static inline uint64_t RotateRight(uint64_t bits, unsigned shift) {
+    shift &= 63;
+    return shift ? (bits >> shift) | (bits << (64 - shift)) : bits;
+}
+
+TimingWheel::TimingWheel(): origin_(Clock::now()), cur_(0), count_(0) {
+    for(int i = 0; i < LEVELS; i++) { bitmap_[i] = 0; }
+    for(auto& head: heads_) {
+        head.prev = head.next = &head;
+    }
+}
+
+uint64_t TimingWheel::NowTick_() const {
+    return std::chrono::duration_cast<MS>(Clock::now() - origin_).count();
+}
+
+/// 按到期时间和当前tick的距离选择层和槽，minTick是允许放入的最早tick
+void TimingWheel::Insert_(WheelNode* node, uint64_t minTick) {
+    uint64_t expires = node->expires < minTick ? minTick : node->expires;
+    uint64_t delta = expires - cur_;
+    int level = 0;
+    while(level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    if(delta >= (1ULL << (SLOT_BITS * LEVELS))) {
+        /// 超出时间轮范围，先放在最高层最远的槽，下沉时再按真实到期时间重新放
+        expires = cur_ + (1ULL << (SLOT_BITS * LEVELS)) - 1;
+    }
+    int index = (expires >> (SLOT_BITS * level)) & SLOT_MASK;
+    WheelNode* head = &heads_[level * SLOTS + index];
+    node->slot = level * SLOTS + index;
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    bitmap_[level] |= 1ULL << index;
+    count_++;
+}
+
+void TimingWheel::Unlink_(WheelNode* node) {
+    assert(node->Linked());
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    WheelNode* head = &heads_[node->slot];
+    if(head->next == head) {
+        bitmap_[node->slot / SLOTS] &= ~(1ULL << (node->slot % SLOTS));
+    }
+    node->prev = node->next = nullptr;
+    node->slot = -1;
+    count_--;
+}
+
+void TimingWheel::add(WheelNode* node, int timeout, const TimeoutCallBack& cb) {
+    assert(node);
+    if(node->Linked()) { Unlink_(node); }
+    node->cb = cb;
+    node->expires = NowTick_() + timeout;
+    Insert_(node, cur_ + 1);
+}
+
+void TimingWheel::adjust(WheelNode* node, int timeout) {
+    assert(node);
+    if(node->Linked()) { Unlink_(node); }
+    node->expires = NowTick_() + timeout;
+    Insert_(node, cur_ + 1);
+}
+
+void TimingWheel::del(WheelNode* node) {
+    assert(node);
+    if(node->Linked()) { Unlink_(node); }
+}
+
+void TimingWheel::clear() {
+    for(auto& head: heads_) {
+        while(head.next != &head) {
+            Unlink_(head.next);
+        }
+    }
+}
+
+/// 下一个需要处理的tick：第0层最近的非空槽，或者更高层最近的非空槽的下沉时刻
+uint64_t TimingWheel::NextEventTick_() const {
+    uint64_t next = UINT64_MAX;
+    for(int level = 0; level < LEVELS; level++) {
+        if(!bitmap_[level]) { continue; }
+        int shift = SLOT_BITS * level;
+        uint64_t base = (cur_ >> shift) + 1;
+        uint64_t dist = __builtin_ctzll(RotateRight(bitmap_[level], base & SLOT_MASK));
+        uint64_t t = (base + dist) << shift;
+        if(t < next) { next = t; }
+    }
+    return next;
+}
+
+/// 高层的一个槽下沉：槽里的结点按剩余时间重新放入低层
+void TimingWheel::Cascade_(int level, int index) {
+    WheelNode* head = &heads_[level * SLOTS + index];
+    while(head->next != head) {
+        WheelNode* node = head->next;
+        Unlink_(node);
+        Insert_(node, cur_);
+    }
+}
+
+void TimingWheel::ProcessTick_(uint64_t t) {
+    cur_ = t;
+    /// 低层转完一圈时，从高到低依次下沉
+    for(int level = LEVELS - 1; level > 0; level--) {
+        if((t & ((1ULL << (SLOT_BITS * level)) - 1)) == 0) {
+            Cascade_(level, (t >> (SLOT_BITS * level)) & SLOT_MASK);
+        }
+    }
+    /// 触发第0层当前槽里的全部结点；回调里可能增删其它结点，所以每次都从表头取
+    WheelNode* head = &heads_[t & SLOT_MASK];
+    while(head->next != head) {
+        WheelNode* node = head->next;
+        Unlink_(node);
+        if(node->cb) { node->cb(); }
+    }
+}
+
+/// 推进时间轮到当前时间，中间没有结点的tick直接跳过
+void TimingWheel::tick() {
+    uint64_t now = NowTick_();
+    while(cur_ < now) {
+        uint64_t next = count_ ? NextEventTick_() : UINT64_MAX;
+        if(next > now) {
+            cur_ = now;
+            break;
+        }
+        ProcessTick_(next);
+    }
+}
+
+int TimingWheel::GetNextTick() {
+    tick();
+    if(count_ == 0) { return -1; }
+    uint64_t next = NextEventTick_();
+    uint64_t now = NowTick_();
+    return next > now ? static_cast<int>(next - now) : 0;
+}
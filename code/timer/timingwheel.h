@@ -0,0 +1,74 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-06-17
+ * @copyleft Apache 2.0
+ */
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <stdint.h>
+#include <assert.h>
+#include <chrono>
+#include <functional>
+#include "heaptimer.h"   /// 复用TimeoutCallBack、Clock、MS的定义
+
+/// 时间轮定时器结点，侵入式地放在使用者（连接槽位）里，增删改都不需要查找和分配内存
+struct WheelNode {
+    WheelNode* prev = nullptr;
+    WheelNode* next = nullptr;
+    uint64_t expires = 0;         /// 到期时间，单位是时间轮的tick(1ms)
+    int slot = -1;                /// 所在的槽，level * SLOTS + index，-1表示不在时间轮上
+    TimeoutCallBack cb;
+
+    bool Linked() const { return slot >= 0; }
+};
+
+/// 分层时间轮：4层，每层64个槽，1tick = 1ms，最大定时约4.6小时（更长的会在最高层反复下沉）
+/// add/adjust/del都是O(1)；GetNextTick()语义和HeapTimer一致：
+/// 先处理到期的定时器，没有定时器返回-1，否则返回距离下一次需要处理的时间(ms)
+class TimingWheel {
+public:
+    TimingWheel();
+
+    /// 结点属于使用者，析构时不再访问它们（使用者可能已经先析构）
+    ~TimingWheel() = default;
+
+    /// 挂上（或重新挂上）结点，timeout毫秒后触发cb
+    void add(WheelNode* node, int timeout, const TimeoutCallBack& cb);
+
+    /// 结点的到期时间重置为timeout毫秒之后
+    void adjust(WheelNode* node, int timeout);
+
+    /// 摘下结点，不触发回调
+    void del(WheelNode* node);
+
+    void clear();
+
+    void tick();
+
+    int GetNextTick();
+
+    size_t size() const { return count_; }
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    uint64_t NowTick_() const;
+    uint64_t NextEventTick_() const;
+    void ProcessTick_(uint64_t t);
+    void Cascade_(int level, int index);
+
+    void Insert_(WheelNode* node, uint64_t minTick);
+    void Unlink_(WheelNode* node);
+
+    Clock::time_point origin_;
+    uint64_t cur_;                          /// 时间轮已经处理到的tick
+    size_t count_;                          /// 时间轮上的结点数量
+    uint64_t bitmap_[LEVELS];               /// 每层哪些槽非空，用来跳过空槽
+    WheelNode heads_[LEVELS * SLOTS];       /// 每个槽一个双向循环链表的哨兵结点
+};
+
+#endif //TIMING_WHEEL_H